@@ -5,10 +5,21 @@
 
 #include <proxy.h>
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 
+// How many bad lines of an --aclFile get reported one by one
+#define ACL_FILE_MAX_ERRORS 10
+
+// States of a reload: a request during one makes it start over when done
+#define ACL_RELOAD_IDLE     0
+#define ACL_RELOAD_RUNNING  1
+#define ACL_RELOAD_AGAIN    2
+
 // -----------------------------------------------------------------------
 void Proxy::addACL(
     char *acl
@@ -38,11 +49,211 @@ void Proxy::addACL(
         ipToStr(mask).c_str()
     );
 
-    acls.push_back(snet);
-    acls.push_back(mask);
+    // Contiguous masks are prefixes and go in the table, anything else gets matched the old way
+    uint32_t m = ntohl(mask);
+    uint32_t rest = ~m;
+    if((rest & (rest+1))==0)
+    {
+        PrefixTable::Prefix prefix;
+        prefix.addr = ntohl(snet) & m;
+        prefix.length = __builtin_popcount(m);
+        prefix.verdict = PrefixTable::ALLOW;
+        aclPrefixes.push_back(prefix);
+    }
+    else
+    {
+        acls.push_back(snet);
+        acls.push_back(mask);
+    }
     free(acl);
 }
 
+// -----------------------------------------------------------------------
+static char *nextWord(
+    char **p
+)
+{
+    char *s = p[0];
+    while(s[0]==' ' || s[0]=='\t') ++s;
+    char *word = s;
+    while(s[0]!=0 && s[0]!=' ' && s[0]!='\t' && s[0]!='\n' && s[0]!='\r') ++s;
+    if(s[0]!=0) *s++ = 0;
+    p[0] = s;
+    return word;
+}
+
+// -----------------------------------------------------------------------
+static int parsePrefix(
+    char                        *line,
+    Proxy::PrefixTable::Prefix  *prefix
+)
+{
+    // One prefix per line, optionally preceded by allow or deny (allow if not said).
+    // Addresses only: resolving names a hundred thousand times over is no way to start
+    char *hash = strchr(line, '#');
+    if(hash!=0) hash[0] = 0;
+
+    char *p = line;
+    char *text = nextWord(&p);
+    if(text[0]==0) return 0;
+
+    prefix->verdict = Proxy::PrefixTable::ALLOW;
+    if(0==strcmp(text, "allow") || 0==strcmp(text, "deny"))
+    {
+        if(text[0]=='d') prefix->verdict = Proxy::PrefixTable::DENY;
+        text = nextWord(&p);
+    }
+    if(nextWord(&p)[0]!=0) return -1;
+
+    prefix->length = 32;
+    char *slash = strchr(text, '/');
+    if(slash!=0)
+    {
+        slash[0] = 0;
+        char *end = 0;
+        prefix->length = strtol(slash+1, &end, 10);
+        if(end==slash+1 || end[0]!=0) return -1;
+    }
+    if(prefix->length<0 || 32<prefix->length) return -1;
+
+    struct in_addr a;
+    if(inet_pton(AF_INET, text, &a)!=1) return -1;
+    prefix->addr = ntohl(a.s_addr);
+    return 1;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::setACLFile(
+    const char *path
+)
+{
+    if(path==0) FAIL(true, 0, "empty argument for --aclFile");
+    if(aclFile!=0) FAIL(true, 0, "only one --aclFile can be given");
+
+    // Reloads happen long after daemonize() moved to /
+    char buffer[PATH_MAX];
+    if(realpath(path, buffer)==0) FAIL(true, "realpath", "couldn't find ACL file %s", path);
+    DBG("using aclFile %s", buffer);
+    aclFile = strdup(buffer);
+}
+
+// -----------------------------------------------------------------------
+Proxy::PrefixTable *Proxy::loadACLTable(
+    bool fatal
+)
+{
+    uint64_t start = now();
+    std::vector<PrefixTable::Prefix> prefixes = aclPrefixes;
+
+    int nbErrors = 0;
+    if(aclFile!=0)
+    {
+        FILE *f = fopen(aclFile, "r");
+        if(f==0)
+        {
+            FAIL(fatal, "fopen", "couldn't open ACL file %s", aclFile);
+            return 0;
+        }
+
+        int lineNumber = 0;
+        char line[1024];
+        while(fgets(line, sizeof(line), f)!=0)
+        {
+            ++lineNumber;
+            PrefixTable::Prefix prefix;
+            int r = parsePrefix(line, &prefix);
+            if(r==0) continue;
+            if(r<0)
+            {
+                if(nbErrors<ACL_FILE_MAX_ERRORS) FAIL(false, 0, "%s:%d: incorrect ACL syntax, ignored", aclFile, lineNumber);
+                ++nbErrors;
+                continue;
+            }
+            prefixes.push_back(prefix);
+        }
+        fclose(f);
+    }
+    int nbFromFile = prefixes.size()-aclPrefixes.size();
+
+    // Shortest of all, any prefix from the file overrides it
+    if(aclFileDefault)
+    {
+        bool hasAllow = false;
+        int n = prefixes.size();
+        for(int i=0; i<n && hasAllow==false; ++i) hasAllow = (prefixes[i].verdict==PrefixTable::ALLOW);
+        if(hasAllow==false)
+        {
+            DBG("no allow in %s, forcing 0/0 (all not denied allowed)", aclFile);
+            PrefixTable::Prefix all;
+            all.addr = 0;
+            all.length = 0;
+            all.verdict = PrefixTable::ALLOW;
+            prefixes.insert(prefixes.begin(), all);
+        }
+    }
+
+    PrefixTable *table = new PrefixTable();
+    table->build(prefixes);
+    INFO(
+        "ACL: %d prefixes (%d from %s, %d bad lines) loaded in %d ms, %d chunks",
+        table->getNbPrefixes(),
+        nbFromFile,
+        aclFile ? aclFile : "no file",
+        nbErrors,
+        (int)(now()-start),
+        table->getNbChunks()
+    );
+    return table;
+}
+
+// -----------------------------------------------------------------------
+void *Proxy::reloadThread(
+    void *vp
+)
+{
+    Proxy *proxy = (Proxy*)vp;
+
+    // A reload asked for meanwhile may be about a newer file, it gets another pass
+    int state = ACL_RELOAD_AGAIN;
+    while(state==ACL_RELOAD_AGAIN)
+    {
+        __atomic_store_n(&proxy->aclReloading, ACL_RELOAD_RUNNING, __ATOMIC_SEQ_CST);
+
+        // Lookups go on with the old table until the new one is complete
+        PrefixTable *table = proxy->loadACLTable(false);
+        if(table!=0)
+        {
+            PrefixTable *old = __atomic_exchange_n(&proxy->aclTable, table, __ATOMIC_SEQ_CST);
+            uint64_t stamp = proxy->epoch.retire();
+            while(proxy->epoch.isQuiescent(stamp)==false) usleep(1000);
+            delete old;
+
+            // Verdicts taken under the old lists don't hold anymore
+            proxy->aclCache.flush();
+        }
+        else proxy->FAIL(false, 0, "ACL reload failed, keeping the previous lists");
+
+        state = ACL_RELOAD_RUNNING;
+        __atomic_compare_exchange_n(&proxy->aclReloading, &state, ACL_RELOAD_IDLE, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::reloadACLTable()
+{
+    if(__atomic_exchange_n(&aclReloading, ACL_RELOAD_AGAIN, __ATOMIC_SEQ_CST)!=ACL_RELOAD_IDLE)
+    {
+        INFO("ACL reload already under way, another one follows");
+        return;
+    }
+
+    if(startThread(reloadThread, this, false, "ACL reload")==false)
+    {
+        __atomic_store_n(&aclReloading, ACL_RELOAD_IDLE, __ATOMIC_SEQ_CST);
+    }
+}
+
 // -----------------------------------------------------------------------
 void Proxy::addACLCommand(
     char *cmd
@@ -53,9 +264,50 @@ void Proxy::addACLCommand(
     aclCmds.push_back(cmd);
 }
 
+// -----------------------------------------------------------------------
+void Proxy::setACLHelper(
+    const char *cmd
+)
+{
+    if(cmd==0) FAIL(true, 0, "empty argument for --aclHelper");
+    if(aclHelper!=0) FAIL(true, 0, "only one --aclHelper can be given");
+    DBG("using aclHelper %s", cmd);
+    aclHelper = cmd;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::setACLCacheSize(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --aclCacheSize");
+    if(1!=sscanf(arg, "%d", &aclCacheSize) || aclCacheSize<0)
+    {
+        FAIL(true, 0, "invalid ACL cache size %s", arg);
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::setACLCacheTTL(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --aclCacheTTL");
+
+    // Refusals are kept as long as approvals unless told otherwise
+    int n = sscanf(arg, "%d,%d", &aclPositiveTTL, &aclNegativeTTL);
+    if(n==1) aclNegativeTTL = aclPositiveTTL;
+    if(n<1 || aclPositiveTTL<0 || aclNegativeTTL<0)
+    {
+        FAIL(true, 0, "invalid ACL cache TTL %s, should be seconds[,seconds]", arg);
+    }
+}
+
 // -----------------------------------------------------------------------
 bool Proxy::checkACL(
-    IPAddr ip
+    IPAddr  ip,
+    bool    *allowed,
+    int     reader
 )
 {
     DBG(
@@ -63,6 +315,24 @@ bool Proxy::checkACL(
         ipToStr(ip).c_str()
     );
 
+    // The most specific prefix has the last word, a deny there isn't up for appeal
+    epoch.enter(reader);
+        PrefixTable *table = __atomic_load_n(&aclTable, __ATOMIC_ACQUIRE);
+        int verdict = table->lookup(ip);
+    epoch.leave(reader);
+
+    allowed[0] = (verdict!=PrefixTable::DENY);
+    if(verdict!=PrefixTable::NO_MATCH)
+    {
+        DBG(
+            "found matching prefix ==> ip %s %s.",
+            ipToStr(ip).c_str(),
+            allowed[0] ? "authorized" : "denied"
+        );
+        return true;
+    }
+
+    allowed[0] = true;
     int n = acls.size();
     for(int i=0; i<n; i+=2)
     {
@@ -80,6 +350,21 @@ bool Proxy::checkACL(
         }
     }
 
+    // Nothing beyond the subnets, nothing worth caching
+    allowed[0] = false;
+    if(aclCmds.empty() && aclHelper==0) return true;
+
+    uint64_t t = now();
+    if(aclCache.lookup(ip, allowed, t))
+    {
+        DBG(
+            "cached verdict for ip %s: %s",
+            ipToStr(ip).c_str(),
+            allowed[0] ? "ok" : "denied"
+        );
+        return true;
+    }
+
     DBG(
         "standard acl failed. Checking ip %s against cmd acl",
         ipToStr(ip).c_str()
@@ -107,9 +392,16 @@ bool Proxy::checkACL(
             ipToStr(ip).c_str(),
             exitStatus==0 ? "ok" : "denied"
         );
-        if(exitStatus==0) return true;
+        if(exitStatus==0)
+        {
+            allowed[0] = true;
+            aclCache.store(ip, true, t);
+            return true;
+        }
     }
 
-    return false;
+    // The helper, if any, still has its say: its answer gets cached when it comes
+    if(aclHelper!=0) return false;
+    aclCache.store(ip, false, t);
+    return true;
 }
-
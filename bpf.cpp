@@ -0,0 +1,168 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+
+#if defined(linux)
+
+#include <errno.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+
+// -----------------------------------------------------------------------
+static int bpf(
+    int             cmd,
+    union bpf_attr  *attr
+)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+// -----------------------------------------------------------------------
+struct bpf_insn Proxy::bpfInsn(
+    uint8_t code,
+    int     dst,
+    int     src,
+    int16_t off,
+    int32_t imm
+)
+{
+    struct bpf_insn i;
+    memset(&i, 0, sizeof(i));
+    i.code = code;
+    i.dst_reg = dst;
+    i.src_reg = src;
+    i.off = off;
+    i.imm = imm;
+    return i;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::bpfLoadMap(
+    std::vector<struct bpf_insn>    &prog,
+    int                             reg,
+    int                             map
+)
+{
+    prog.push_back(bpfInsn(BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_FD, 0, map));
+    prog.push_back(bpfInsn(0, 0, 0, 0, 0));
+}
+
+// -----------------------------------------------------------------------
+int Proxy::bpfMapCreate(
+    int         type,
+    int         keySize,
+    int         valueSize,
+    int         maxEntries,
+    const char  *name
+)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = keySize;
+    attr.value_size = valueSize;
+    attr.max_entries = maxEntries;
+    strncpy(attr.map_name, name, sizeof(attr.map_name)-1);
+
+    int fd = bpf(BPF_MAP_CREATE, &attr);
+    if(fd<0) FAIL(false, "bpf", "couldn't create BPF map %s", name);
+    return fd;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::bpfMapUpdate(
+    int         map,
+    const void  *key,
+    const void  *value
+)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    attr.flags = BPF_ANY;
+    return 0<=bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::bpfMapDelete(
+    int         map,
+    const void  *key
+)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map;
+    attr.key = (uint64_t)(uintptr_t)key;
+    return 0<=bpf(BPF_MAP_DELETE_ELEM, &attr) || errno==ENOENT;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::bpfMapLookup(
+    int         map,
+    const void  *key,
+    void        *value
+)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    return 0<=bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+// -----------------------------------------------------------------------
+int Proxy::bpfProgLoad(
+    int                     type,
+    const struct bpf_insn   *insns,
+    int                     nbInsns,
+    const char              *name
+)
+{
+    static char verifierLog[65536];
+    verifierLog[0] = 0;
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = type;
+    attr.insns = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt = nbInsns;
+    attr.license = (uint64_t)(uintptr_t)"Dual BSD/GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)verifierLog;
+    attr.log_size = sizeof(verifierLog);
+    attr.log_level = 1;
+    strncpy(attr.prog_name, name, sizeof(attr.prog_name)-1);
+
+    int fd = bpf(BPF_PROG_LOAD, &attr);
+    if(fd<0)
+    {
+        FAIL(false, "bpf", "couldn't load BPF program %s", name);
+        DBG("BPF verifier said:\n%s", verifierLog);
+    }
+    return fd;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::bpfLinkCreate(
+    int         prog,
+    int         ifIndex,
+    int         attachType,
+    uint32_t    flags
+)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog;
+    attr.link_create.target_ifindex = ifIndex;
+    attr.link_create.attach_type = attachType;
+    attr.link_create.flags = flags;
+    return bpf(BPF_LINK_CREATE, &attr);
+}
+
+#endif // linux
@@ -0,0 +1,198 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+#include <pthread.h>
+
+// -----------------------------------------------------------------------
+// Verdicts of the external ACL checks, by caller IP. Entries sit in a fixed array
+// threaded on a doubly-linked list, most recently used first, so that a full cache
+// gives up the entry that went the longest without being asked for.
+#define CACHE_NONE  (-1)
+
+// -----------------------------------------------------------------------
+Proxy::ACLCache::ACLCache()
+    :
+        capacity(0),
+        positiveTTL(0),
+        negativeTTL(0),
+        head(CACHE_NONE),
+        tail(CACHE_NONE),
+        hits(0),
+        misses(0),
+        evictions(0),
+        flushes(0)
+{
+    pthread_mutex_t iLock = PTHREAD_MUTEX_INITIALIZER;
+    lock = iLock;
+}
+
+// -----------------------------------------------------------------------
+Proxy::ACLCache::~ACLCache()
+{
+    pthread_mutex_destroy(&lock);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLCache::configure(
+    int size,
+    int positive,
+    int negative
+)
+{
+    // Before any reactor runs
+    capacity = size;
+    positiveTTL = positive;
+    negativeTTL = negative;
+    entries.clear();
+    entries.reserve(capacity);
+    index.clear();
+    head = tail = CACHE_NONE;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLCache::unlink(
+    int i
+)
+{
+    Entry &e = entries[i];
+    if(e.prev!=CACHE_NONE) entries[e.prev].next = e.next;
+    else                   head = e.next;
+    if(e.next!=CACHE_NONE) entries[e.next].prev = e.prev;
+    else                   tail = e.prev;
+    e.prev = e.next = CACHE_NONE;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLCache::pushFront(
+    int i
+)
+{
+    Entry &e = entries[i];
+    e.prev = CACHE_NONE;
+    e.next = head;
+    if(head!=CACHE_NONE) entries[head].prev = i;
+    head = i;
+    if(tail==CACHE_NONE) tail = i;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLCache::remove(
+    int i
+)
+{
+    // The last array slot moves into the hole, so that the array stays dense
+    unlink(i);
+    index.erase(entries[i].ip);
+
+    int last = entries.size()-1;
+    if(i!=last)
+    {
+        Entry &moved = entries[last];
+        entries[i] = moved;
+        index[moved.ip] = i;
+        if(moved.prev!=CACHE_NONE) entries[moved.prev].next = i;
+        else                       head = i;
+        if(moved.next!=CACHE_NONE) entries[moved.next].prev = i;
+        else                       tail = i;
+    }
+    entries.pop_back();
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::ACLCache::lookup(
+    IPAddr      ip,
+    bool        *allowed,
+    uint64_t    now
+)
+{
+    if(capacity<=0) return false;
+
+    bool hit = false;
+    pthread_mutex_lock(&lock);
+        std::map<IPAddr, int>::iterator it = index.find(ip);
+        if(it!=index.end())
+        {
+            int i = it->second;
+            if(now<entries[i].expires)
+            {
+                allowed[0] = entries[i].allowed;
+                unlink(i);
+                pushFront(i);
+                hit = true;
+            }
+            else remove(i);
+        }
+        if(hit) ++hits;
+        else    ++misses;
+    pthread_mutex_unlock(&lock);
+    return hit;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLCache::store(
+    IPAddr      ip,
+    bool        allowed,
+    uint64_t    now
+)
+{
+    // A TTL of 0 keeps that kind of verdict out of the cache
+    int ttl = allowed ? positiveTTL : negativeTTL;
+    if(capacity<=0 || ttl<=0) return;
+
+    pthread_mutex_lock(&lock);
+        int i;
+        std::map<IPAddr, int>::iterator it = index.find(ip);
+        if(it!=index.end())
+        {
+            i = it->second;
+            unlink(i);
+        }
+        else
+        {
+            if((int)entries.size()>=capacity)
+            {
+                remove(tail);
+                ++evictions;
+            }
+            i = entries.size();
+            entries.push_back(Entry());
+            entries[i].ip = ip;
+            index[ip] = i;
+        }
+        entries[i].allowed = allowed;
+        entries[i].expires = now + 1000*(uint64_t)ttl;
+        pushFront(i);
+    pthread_mutex_unlock(&lock);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLCache::flush()
+{
+    pthread_mutex_lock(&lock);
+        entries.clear();
+        index.clear();
+        head = tail = CACHE_NONE;
+        ++flushes;
+    pthread_mutex_unlock(&lock);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLCache::getStats(
+    int         *size,
+    uint64_t    *nbHits,
+    uint64_t    *nbMisses,
+    uint64_t    *nbEvictions,
+    uint64_t    *nbFlushes
+)
+{
+    pthread_mutex_lock(&lock);
+        size[0] = entries.size();
+        nbHits[0] = hits;
+        nbMisses[0] = misses;
+        nbEvictions[0] = evictions;
+        nbFlushes[0] = flushes;
+    pthread_mutex_unlock(&lock);
+}
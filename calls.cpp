@@ -0,0 +1,278 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+#include <stdlib.h>
+
+// -----------------------------------------------------------------------
+// Open addressing with linear probing, kept at most half full so probes stay short.
+// Slots name immutable records: writers swap them under the DB lock, GRE threads read
+// them inside an epoch and never wait. Whatever gets unlinked is recycled once the
+// epoch it was retired in has drained.
+#define CALL_INDEX_MIN_SIZE 1024
+
+// Slot layout: key hash in the top half, record number plus 2 in the bottom one
+#define SLOT_FREE           ((uint64_t)0)
+#define SLOT_DELETED        ((uint64_t)1)
+#define SLOT_MAKE(h, r)     ((((uint64_t)(h))<<32) | ((r)+2))
+#define SLOT_HASH(w)        ((uint32_t)((w)>>32))
+#define SLOT_RECORD(w)      ((uint32_t)(w)-2)
+#define SLOT_LIVE(w)        (SLOT_DELETED<(w))
+
+// -----------------------------------------------------------------------
+Proxy::CallIndex::CallIndex(
+    Epoch *_epoch
+)
+    :
+        epoch(_epoch),
+        table(0),
+        used(0),
+        live(0),
+        nbChunks(0)
+{
+    memset(chunks, 0, sizeof(chunks));
+    resize(CALL_INDEX_MIN_SIZE);
+}
+
+// -----------------------------------------------------------------------
+Proxy::CallIndex::~CallIndex()
+{
+    delete [] table->slots;
+    delete table;
+
+    int n = garbage.size();
+    for(int i=0; i<n; ++i)
+    {
+        if(garbage[i].table) delete [] garbage[i].table->slots;
+        delete garbage[i].table;
+    }
+    for(int i=0; i<nbChunks; ++i) free(chunks[i]);
+}
+
+// -----------------------------------------------------------------------
+uint32_t Proxy::CallIndex::hash(
+    IPAddr  src,
+    CallId  fakeId
+)
+{
+    uint32_t h = src*0x9E3779B1 ^ fakeId*0x85EBCA6B;
+    h ^= h>>15;
+    h *= 0x2C1B3C6D;
+    h ^= h>>12;
+    return h;
+}
+
+// -----------------------------------------------------------------------
+uint32_t Proxy::CallIndex::allocRecord()
+{
+    if(freeRecords.empty())
+    {
+        // Cache line aligned so that no record straddles two lines
+        if(CALL_MAX_CHUNKS<=nbChunks) return ~0U;
+        void *chunk = 0;
+        if(posix_memalign(&chunk, 64, CALL_CHUNK_SIZE*sizeof(Entry))!=0) return ~0U;
+        memset(chunk, 0, CALL_CHUNK_SIZE*sizeof(Entry));
+
+        // Readers only ever reach a chunk through a slot published after this
+        __atomic_store_n(chunks+nbChunks, (Entry*)chunk, __ATOMIC_RELEASE);
+        uint32_t base = nbChunks*CALL_CHUNK_SIZE;
+        ++nbChunks;
+        for(int i=CALL_CHUNK_SIZE; 0<i--; ) freeRecords.push_back(base+i);
+    }
+
+    uint32_t r = freeRecords.back();
+    freeRecords.pop_back();
+    return r;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::CallIndex::place(
+    Table       *t,
+    uint64_t    slot
+)
+{
+    // Only for keys that aren't in the table yet: any free or deleted slot on the way will do
+    uint32_t mask = t->capacity-1;
+    uint32_t i = SLOT_HASH(slot) & mask;
+    while(SLOT_LIVE(t->slots[i])) i = (i+1) & mask;
+
+    if(t->slots[i]==SLOT_FREE) ++used;
+    __atomic_store_n(t->slots+i, slot, __ATOMIC_RELEASE);
+    ++live;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::CallIndex::resize(
+    int size
+)
+{
+    // The new table is filled in private, then swapped in whole
+    Table *t = new Table;
+    t->capacity = size;
+    t->slots = new uint64_t[size];
+    memset(t->slots, 0, size*sizeof(uint64_t));
+    used = 0;
+    live = 0;
+
+    // Deleted slots don't survive a resize, live records move over as they are
+    Table *old = table;
+    for(int i=0; old && i<old->capacity; ++i)
+    {
+        if(SLOT_LIVE(old->slots[i])) place(t, old->slots[i]);
+    }
+    __atomic_store_n(&table, t, __ATOMIC_RELEASE);
+    if(old) dispose(~0U, old);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::CallIndex::dispose(
+    uint32_t    record,
+    Table       *t
+)
+{
+    Garbage g;
+    g.stamp = epoch->retire();
+    g.record = record;
+    g.table = t;
+    garbage.push_back(g);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::CallIndex::collect()
+{
+    // Stamps only go up, so the oldest garbage is up front
+    int n = garbage.size();
+    int done = 0;
+    while(done<n && epoch->isQuiescent(garbage[done].stamp))
+    {
+        if(garbage[done].record!=~0U) freeRecords.push_back(garbage[done].record);
+        if(garbage[done].table) delete [] garbage[done].table->slots;
+        delete garbage[done].table;
+        ++done;
+    }
+    if(0<done) garbage.erase(garbage.begin(), garbage.begin()+done);
+}
+
+// -----------------------------------------------------------------------
+const Proxy::CallIndex::Entry *Proxy::CallIndex::find(
+    IPAddr  src,
+    CallId  fakeId
+)
+{
+    // Wait-free: bounded by the table size, whatever writers are doing meanwhile.
+    // Records are only looked at when the hash matches, which is almost always the right one.
+    Table *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    uint32_t h = hash(src, fakeId);
+    uint32_t mask = t->capacity-1;
+    uint32_t i = h & mask;
+    for(int probes=0; probes<t->capacity; ++probes)
+    {
+        uint64_t w = __atomic_load_n(t->slots+i, __ATOMIC_ACQUIRE);
+        if(w==SLOT_FREE) return 0;
+        if(SLOT_LIVE(w) && SLOT_HASH(w)==h)
+        {
+            uint32_t r = SLOT_RECORD(w);
+            const Entry *e = __atomic_load_n(chunks + r/CALL_CHUNK_SIZE, __ATOMIC_ACQUIRE) + r%CALL_CHUNK_SIZE;
+            if(e->src==src && e->fakeId==fakeId) return e;
+        }
+        i = (i+1) & mask;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::CallIndex::slotOf(
+    IPAddr  src,
+    CallId  fakeId
+)
+{
+    // Writers only, under the DB lock: nobody else changes the slots meanwhile
+    uint32_t h = hash(src, fakeId);
+    uint32_t mask = table->capacity-1;
+    uint32_t i = h & mask;
+    while(1)
+    {
+        uint64_t w = table->slots[i];
+        if(w==SLOT_FREE) return -1;
+        if(SLOT_LIVE(w) && SLOT_HASH(w)==h)
+        {
+            const Entry *e = record(SLOT_RECORD(w));
+            if(e->src==src && e->fakeId==fakeId) return i;
+        }
+        i = (i+1) & mask;
+    }
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::CallIndex::insert(
+    const Entry &entry
+)
+{
+    collect();
+
+    uint32_t r = allocRecord();
+    if(r==~0U) return false;
+    record(r)[0] = entry;
+    uint64_t slot = SLOT_MAKE(hash(entry.src, entry.fakeId), r);
+
+    // Known call: the new version goes where the old one was so that readers always find one
+    int i = slotOf(entry.src, entry.fakeId);
+    if(0<=i)
+    {
+        uint64_t old = table->slots[i];
+        __atomic_store_n(table->slots+i, slot, __ATOMIC_RELEASE);
+        dispose(SLOT_RECORD(old), 0);
+        return true;
+    }
+
+    if(table->capacity<=2*(used+1))
+    {
+        // Mostly tombstones: same size will do, just clean up
+        int size = (table->capacity<=4*(live+1)) ? 2*table->capacity : table->capacity;
+        resize(size);
+    }
+    place(table, slot);
+    return true;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::CallIndex::remove(
+    IPAddr  src,
+    CallId  fakeId
+)
+{
+    collect();
+
+    int i = slotOf(src, fakeId);
+    if(i<0) return;
+    uint64_t old = table->slots[i];
+    __atomic_store_n(table->slots+i, SLOT_DELETED, __ATOMIC_RELEASE);
+    --live;
+    dispose(SLOT_RECORD(old), 0);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::publishCall(
+    const CallIndex::Entry  &call,
+    IPAddr                  out,
+    bool                    known,
+    bool                    offload
+)
+{
+    // Caller holds the DB lock, GRE threads look calls up from within their epoch
+    if(call.fakeId==(CallId)~0) return;
+    if(known==false) callIndex.remove(call.src, call.fakeId);
+    else if(callIndex.insert(call)==false)
+    {
+        FAIL(
+            false,
+            0,
+            "call index full, dropping GRE from %s for call 0x%X",
+            ipToStr(call.src).c_str(),
+            call.fakeId
+        );
+    }
+    publishOffload(call.src, call.fakeId, call.dst, out, call.realId, known, offload);
+}
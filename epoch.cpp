@@ -0,0 +1,72 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+
+// -----------------------------------------------------------------------
+// A reader slot holds the epoch it entered in, or 0 while it is outside.
+// Epochs start at 1 and only ever go up.
+#define EPOCH_IDLE 0
+
+// -----------------------------------------------------------------------
+Proxy::Epoch::Epoch()
+    :
+        global(1),
+        nbReaders(0)
+{
+    memset(readers, 0, sizeof(readers));
+}
+
+// -----------------------------------------------------------------------
+int Proxy::Epoch::addReader()
+{
+    // Readers are added before their thread starts, from the main thread only
+    if(EPOCH_MAX_READERS<=nbReaders) return -1;
+    int reader = nbReaders;
+    __atomic_store_n(&nbReaders, reader+1, __ATOMIC_SEQ_CST);
+    return reader;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Epoch::enter(
+    int reader
+)
+{
+    // The fence keeps any load of shared pointers from moving above the announcement
+    uint64_t e = __atomic_load_n(&global, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&readers[reader].epoch, e, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Epoch::leave(
+    int reader
+)
+{
+    __atomic_store_n(&readers[reader].epoch, (uint64_t)EPOCH_IDLE, __ATOMIC_RELEASE);
+}
+
+// -----------------------------------------------------------------------
+uint64_t Proxy::Epoch::retire()
+{
+    // Whatever got unlinked before this is reachable only by readers that entered at or before the stamp
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_fetch_add(&global, 1, __ATOMIC_SEQ_CST);
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Epoch::isQuiescent(
+    uint64_t stamp
+)
+{
+    // Idle readers and readers that entered after the stamp can't hold anything retired with it
+    int n = __atomic_load_n(&nbReaders, __ATOMIC_SEQ_CST);
+    for(int i=0; i<n; ++i)
+    {
+        uint64_t e = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+        if(e!=EPOCH_IDLE && e<=stamp) return false;
+    }
+    return true;
+}
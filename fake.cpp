@@ -6,16 +6,81 @@
 #include <proxy.h>
 
 // -----------------------------------------------------------------------
-Proxy::CallId Proxy::allocCalleeId()
+// Fake ids only need to be unique among the calls a given peer sees, so each
+// peer IP gets its own 16-bit space. Allocation is next-fit from where the last
+// one left off, so a freed id isn't handed out again before the space wraps.
+#define ID_SPACE_SIZE   65536
+#define ID_NONE         0xFFFF
+
+// -----------------------------------------------------------------------
+Proxy::CallId Proxy::allocCallId(
+    IPAddr peer
+)
 {
-    calleeIdPool += 2;
-    return calleeIdPool;
+    CallId result = ~0;
+    pthread_mutex_lock(idLock);
+
+        IdSpace *space = idSpaces[peer];
+        if(space==0)
+        {
+            // 0 and 0xFFFF read as "no call" to some stacks, keep them out
+            space = new IdSpace;
+            memset(space, 0, sizeof(*space));
+            space->bits[0] |= 1;
+            space->bits[ID_NONE/64] |= ((uint64_t)1)<<(ID_NONE%64);
+            space->used = 2;
+            space->next = 1;
+            idSpaces[peer] = space;
+        }
+
+        // A word at a time: skip the full ones, then take the lowest clear bit at or after the cursor
+        int nbWords = ID_SPACE_SIZE/64;
+        int w = space->next/64;
+        uint64_t mask = ~(uint64_t)0 << (space->next%64);
+        for(int i=0; space->used<ID_SPACE_SIZE && i<=nbWords; ++i)
+        {
+            uint64_t clear = ~space->bits[w] & mask;
+            if(clear!=0)
+            {
+                int bit = __builtin_ctzll(clear);
+                space->bits[w] |= ((uint64_t)1)<<bit;
+                ++space->used;
+                result = w*64 + bit;
+                space->next = (result+1) % ID_SPACE_SIZE;
+                break;
+            }
+            w = (w+1) % nbWords;
+            mask = ~(uint64_t)0;
+        }
+
+    pthread_mutex_unlock(idLock);
+    return result;
 }
 
 // -----------------------------------------------------------------------
-Proxy::CallId Proxy::allocCallerId()
+void Proxy::freeCallId(
+    IPAddr  peer,
+    CallId  id
+)
 {
-    callerIdPool += 2;
-    return callerIdPool;
-}
+    if(id==(CallId)~0) return;
+    pthread_mutex_lock(idLock);
+
+        std::map<IPAddr, IdSpace*>::iterator i = idSpaces.find(peer);
+        uint64_t bit = ((uint64_t)1)<<(id%64);
+        if(i!=idSpaces.end() && (i->second->bits[id/64] & bit))
+        {
+            IdSpace *space = i->second;
+            space->bits[id/64] &= ~bit;
+            --space->used;
 
+            // Peers come and go, their spaces shouldn't pile up
+            if(space->used<=2)
+            {
+                delete space;
+                idSpaces.erase(i);
+            }
+        }
+
+    pthread_mutex_unlock(idLock);
+}
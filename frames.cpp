@@ -0,0 +1,149 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+#include <sched.h>
+#include <sys/uio.h>
+
+// -----------------------------------------------------------------------
+// GRE threads push whole packets, the link's reactor takes them out and frames them
+// on the way to the socket. Records are a 32-bit length then the packet, 4-byte
+// aligned; one that doesn't fit before the end of the buffer starts over at its head,
+// behind a padding marker. Producers only serialize among themselves: with fanout,
+// several GRE threads can have packets for the same link, so the ring takes many
+// producers and one consumer rather than exactly one of each.
+//
+// push() copies the packet: the receive buffers it comes out of (packet ring blocks,
+// provided io_uring buffers, recvmmsg() arrays) go back to the kernel as soon as the
+// GRE thread is through with them, not when a reactor gets round to this link. That
+// is the one copy on the way, the header goes next to it in its own iovec.
+#define FRAME_PAD       0xFFFFFFFF
+#define FRAME_MASK      (FRAME_RING_SIZE-1)
+#define FRAME_ALIGN(n)  (((n)+3) & ~3)
+
+// Spins on a taken lock before giving the CPU away: the holder only copies one packet
+#define FRAME_SPINS     64
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define FRAME_PAUSE()   __builtin_ia32_pause()
+#else
+    #define FRAME_PAUSE()   __asm__ __volatile__("" ::: "memory")
+#endif
+
+// -----------------------------------------------------------------------
+Proxy::FrameRing::FrameRing()
+    :
+        head(0),
+        tail(0),
+        lock(0)
+{
+    buffer = new uint8_t[FRAME_RING_SIZE];
+}
+
+// -----------------------------------------------------------------------
+Proxy::FrameRing::~FrameRing()
+{
+    delete [] buffer;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::FrameRing::push(
+    const uint8_t   *p,
+    int             n,
+    bool            *wasEmpty
+)
+{
+    // Waiters spin on a plain load, not on the exchange, and back off to the scheduler
+    // when the holder doesn't let go quickly (it may have been preempted)
+    uint32_t size = FRAME_ALIGN(4+n);
+    int spins = 0;
+    while(__atomic_exchange_n(&lock, 1, __ATOMIC_ACQUIRE))
+    {
+        while(__atomic_load_n(&lock, __ATOMIC_RELAXED))
+        {
+            if(++spins<FRAME_SPINS) FRAME_PAUSE();
+            else
+            {
+                sched_yield();
+                spins = 0;
+            }
+        }
+    }
+
+        uint32_t t = tail;
+        uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        uint32_t offset = t & FRAME_MASK;
+        uint32_t pad = (FRAME_RING_SIZE<offset+size) ? FRAME_RING_SIZE-offset : 0;
+        bool ok = (t-h+pad+size<=FRAME_RING_SIZE);
+        if(ok)
+        {
+            if(pad)
+            {
+                *(uint32_t*)(buffer+offset) = FRAME_PAD;
+                offset = 0;
+            }
+            *(uint32_t*)(buffer+offset) = n;
+            memcpy(buffer+offset+4, p, n);
+            wasEmpty[0] = (h==t);
+            __atomic_store_n(&tail, t+pad+size, __ATOMIC_RELEASE);
+        }
+
+    __atomic_store_n(&lock, 0, __ATOMIC_RELEASE);
+    return ok;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::FrameRing::peek(
+    struct iovec    *frames,
+    int             max
+)
+{
+    // Consumer only: the packets stay where they are until consumed
+    uint32_t h = head;
+    uint32_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    int nb = 0;
+    while(h!=t && nb<max)
+    {
+        uint32_t offset = h & FRAME_MASK;
+        uint32_t n = *(uint32_t*)(buffer+offset);
+        if(n==FRAME_PAD)
+        {
+            h += FRAME_RING_SIZE-offset;
+            continue;
+        }
+        frames[nb].iov_base = buffer+offset+4;
+        frames[nb].iov_len = n;
+        h += FRAME_ALIGN(4+n);
+        ++nb;
+    }
+    return nb;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::FrameRing::consume(
+    int nb
+)
+{
+    uint32_t h = head;
+    while(0<nb)
+    {
+        uint32_t offset = h & FRAME_MASK;
+        uint32_t n = *(uint32_t*)(buffer+offset);
+        if(n==FRAME_PAD)
+        {
+            h += FRAME_RING_SIZE-offset;
+            continue;
+        }
+        h += FRAME_ALIGN(4+n);
+        --nb;
+    }
+    __atomic_store_n(&head, h, __ATOMIC_RELEASE);
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::FrameRing::isEmpty()
+{
+    return __atomic_load_n(&tail, __ATOMIC_ACQUIRE)==head;
+}
@@ -4,15 +4,24 @@
  */
 
 #include <proxy.h>
+#include <poll.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#if defined(linux)
+    #include <linux/filter.h>
+    #include <linux/if_ether.h>
+    #include <linux/if_packet.h>
+    #include <linux/io_uring.h>
+#endif
+
 // -----------------------------------------------------------------------
 #if defined(__CYGWIN__)
     #define IP_HDRINCL 2
@@ -26,177 +35,496 @@
     #define SOL_IP 0
 #endif
 
+// io_uring: one provided buffer per packet in flight, sends tagged with the buffer they go out of
+#define GRE_URING_BUFFERS   1024
+#define GRE_URING_RECV      (((uint64_t)1)<<32)
+
+// TPACKET_V3 blocks are retired when full or after GRE_RING_TIMEOUT ms, whichever comes first
+#define GRE_RING_BLOCK_SIZE (1<<18)
+#define GRE_RING_BLOCKS     16
+#define GRE_RING_FRAME_SIZE 2048
+#define GRE_RING_TIMEOUT    1
+
 // -----------------------------------------------------------------------
-void Proxy::greThread()
+bool Proxy::forwardGRE(
+    uint8_t             *buf,
+    int                 n,
+    IPAddr              src,
+    struct sockaddr_in  *to
+)
 {
-    DBG("GRE thread: up and running -- waiting for GRE packets");
+    DBG("GRE thread: received GRE data packet");
 
-    uint8_t buf[4100];
-    while(1)
+    // Ring frames and provided buffers end where the packet does: the IP header has to be
+    // whole and leave room for the GRE header up to the call id before anything is read
+    ssize_t savedN = n;
+    uint8_t *packet = buf;
+    if((buf[0]&0xF0)==0x40)
     {
-        struct sockaddr_in from;
-        socklen_t fromLen = sizeof(from);
-        memset(&from, 0, fromLen);
+        int headerSize = (buf[0]&0x0F)*4;
+        if(headerSize<20 || n<headerSize+8)
+        {
+            DBG("GRE thread: dropping short GRE packet, %d bytes, IP header %d bytes", n, headerSize);
+            return false;
+        }
+        packet += headerSize;
+        n -= headerSize;
+    }
+    else if(n<8)
+    {
+        DBG("GRE thread: dropping short GRE packet, %d bytes", n);
+        return false;
+    }
 
-        int n = recvfrom(
-            greSocket,
-            buf,
-            4096,   // TODO: ought to sniff MTU here instead of assuming
-            0,
-            (struct sockaddr*)&from,
-            &fromLen
-        );
+    uint32_t dst;
+    uint32_t callId = packet[6] | (((uint32_t)packet[7])<<8);
+
+    DBG(
+        "GRE thread: GRE data packet from %s, callId = 0x%X",
+        ipToStr(src).c_str(),
+        callId
+    );
+
+    if(isPacketDumpOn())
+    {
+        DBG("GRE thread: GRE packet dump follows, length = %d", savedN);
+        dumpPacket(buf, savedN);
+    }
+
+    uint32_t out;
+    CallId realCallId;
+    Link *wrapLink = 0;
+    bool wrapToCaller = false;
+    TCPPort trunkPort = 0;
+
+    bool found = findPeer(&dst, &realCallId, src, callId, &wrapLink, &wrapToCaller, &out, &trunkPort);
+    if(found==false)
+    {
+        FAIL(false, 0, "GRE thread: peer not found, dropping packet");
+        return false;
+    }
+
+    memset(to, 0, sizeof(*to));
+    to->sin_family = AF_INET;
+    to->sin_addr.s_addr = dst;
+    to->sin_port = htons(trunkPort);    // 0 for raw GRE: IPPROTO_GRE according to raw(7), but doesn't work
+
+    DBG(
+        "GRE thread: GRE data packet peer is at %s, realCallId = 0x%X",
+        ipToStr(dst).c_str(),
+        realCallId
+    );
+
+    packet[6] = (realCallId>>0)&0xFF;
+    packet[7] = (realCallId>>8)&0xFF;
+
+    DBG(
+        "GRE thread: GRE data packet callId patched from 0x%X to 0x%X",
+        callId,
+        realCallId
+    );
+
+    if(wrapLink!=0)
+    {
+        // Framed and written out by the link's reactor, the only one writing to its sockets
+        DBG("GRE thread: peer supports PPTP-IN-TCP, wrapping GRE data packet into TCP packet");
+        wrapLink->sendWrapped(wrapToCaller, packet, n);
+        return false;
+    }
+
+    // The header is set up either way: a trunk datagram leaves from the address it names
+    DBG(
+        "GRE thread: forwarding GRE data packet from %s to %s via interface %s%s\n",
+        ipToStr(src).c_str(),
+        ipToStr(dst).c_str(),
+        ipToStr(out).c_str(),
+        trunkPort ? " over the UDP trunk" : ""
+    );
+
+    ((uint16_t*)(buf+ 2))[0] = savedN;  // reset id
+    ((uint16_t*)(buf+ 4))[0] = 0;       // reset id
+    ((uint16_t*)(buf+10))[0] = 0;       // reset checksum
+    ((uint32_t*)(buf+12))[0] = out;     // set expected source
+    ((uint32_t*)(buf+16))[0] = dst;     // set destination
+    return true;
+}
+
+// -----------------------------------------------------------------------
+Proxy::GREWorker::GREWorker(
+    Proxy       *_proxy,
+    int         _id,
+    int         _rxSocket,
+    int         _txSocket,
+    uint8_t     *_ring,
+    XDPSocket   *_xsk,
+    int         _trunkSocket,
+    bool        _fromTrunk
+)
+    :
+        proxy(_proxy),
+        id(_id),
+        rxSocket(_rxSocket),
+        txSocket(_txSocket),
+        ring(_ring),
+        xsk(_xsk),
+        trunkSocket(_trunkSocket),
+        fromTrunk(_fromTrunk),
+        batch(_proxy->greBatch),
+        nbOut(0),
+        nbTrunk(0)
+{
+    reader = proxy->epoch.addReader();
+    if(reader<0) proxy->FAIL(true, 0, "too many GRE threads, at most %d", EPOCH_MAX_READERS);
+
+    outMsgs = new struct mmsghdr[batch];
+    outIovs = new struct iovec[batch];
+    to = new struct sockaddr_in[batch];
+
+    memset(outMsgs, 0, batch*sizeof(outMsgs[0]));
+    for(int i=0; i<batch; ++i)
+    {
+        outMsgs[i].msg_hdr.msg_iov = outIovs + i;
+        outMsgs[i].msg_hdr.msg_iovlen = 1;
+        outMsgs[i].msg_hdr.msg_name = to + i;
+        outMsgs[i].msg_hdr.msg_namelen = sizeof(to[i]);
+    }
+
+    trunkMsgs = 0;
+    trunkIovs = 0;
+    trunkTo = 0;
+    trunkFrom = 0;
+    trunkStarts = 0;
+    trunkControl = 0;
+    if(0<=trunkSocket)
+    {
+        trunkMsgs = new struct mmsghdr[batch];
+        trunkIovs = new struct iovec[batch];
+        trunkTo = new struct sockaddr_in[batch];
+        trunkFrom = new IPAddr[batch];
+        trunkStarts = new int[batch];
+        trunkControl = new uint8_t[batch*TRUNK_CONTROL_SIZE];
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::GREWorker::forward(
+    uint8_t *buf,
+    int     n
+)
+{
+    if(n<20 || (buf[0]&0xF0)!=0x40) return;
+
+    // Both raw and packet sockets hand us the IP header, take the source from there
+    IPAddr src = ((uint32_t*)(buf+12))[0];
+    if(proxy->forwardGRE(buf, n, src, to+nbOut))
+    {
+        if(to[nbOut].sin_port!=0)
+        {
+            trunkOut(buf, n, to+nbOut);
+            return;
+        }
+
+        outIovs[nbOut].iov_base = buf;
+        outIovs[nbOut].iov_len = n;
+        ++nbOut;
+    }
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::GREWorker::flush()
+{
+    if(flushTrunk()==false) return false;
 
-        if(n<0)
+    int sent = 0;
+    while(sent<nbOut)
+    {
+        int count = sendmmsg(txSocket, outMsgs+sent, nbOut-sent, 0);
+        if(count<0 && errno==EINTR) continue;
+        if(count<=0) break;
+        sent += count;
+    }
+
+    bool ok = (sent==nbOut);
+    if(ok==false) proxy->FAIL(false, "sendmmsg", "sendmmsg failed on GRE socket");
+    nbOut = 0;
+    return ok;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::GREWorker::runSocket()
+{
+    uint8_t *bufs = new uint8_t[batch*GRE_BUFFER_SIZE];
+    struct mmsghdr *inMsgs = new struct mmsghdr[batch];
+    struct iovec *inIovs = new struct iovec[batch];
+
+    memset(inMsgs, 0, batch*sizeof(inMsgs[0]));
+    for(int i=0; i<batch; ++i)
+    {
+        inIovs[i].iov_base = bufs + i*GRE_BUFFER_SIZE;
+        inIovs[i].iov_len = GRE_BUFFER_SIZE;   // TODO: ought to sniff MTU here instead of assuming
+        inMsgs[i].msg_hdr.msg_iov = inIovs + i;
+        inMsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(1)
+    {
+        // Block for the first packet only, then take whatever else is already there
+        int got = recvmmsg(rxSocket, inMsgs, batch, MSG_WAITFORONE, 0);
+        if(got<0)
         {
                  if(errno==EINTR)   continue;
             else if(errno==EAGAIN)  continue;
             else
             {
-                FAIL(false, "recvfrom", "recvfrom failed on GRE socket");
+                proxy->FAIL(false, "recvmmsg", "recvmmsg failed on GRE socket");
                 break;
             }
         }
 
-        DBG("GRE thread: received GRE data packet");
+        // One epoch for the whole batch
+        proxy->epoch.enter(reader);
+            for(int i=0; i<got; ++i) forward((uint8_t*)inIovs[i].iov_base, inMsgs[i].msg_len);
+        proxy->epoch.leave(reader);
+        if(flush()==false) break;
+    }
+}
+
+// -----------------------------------------------------------------------
+#if defined(linux)
 
-        ssize_t savedN = n;
-        uint8_t *packet = buf;
-        if((buf[0]&0xF0)==0x40)
+    void Proxy::GREWorker::runRing()
+    {
+        int block = 0;
+        while(1)
         {
-            int headerSize = (buf[0]&0x0F)*4;
-            packet += headerSize;
-            n -= headerSize;
+            struct tpacket_block_desc *desc = (struct tpacket_block_desc*)(ring + block*GRE_RING_BLOCK_SIZE);
+            if((desc->hdr.bh1.block_status & TP_STATUS_USER)==0)
+            {
+                struct pollfd pfd;
+                pfd.fd = rxSocket;
+                pfd.events = POLLIN | POLLERR;
+                pfd.revents = 0;
+                if(poll(&pfd, 1, -1)<0 && errno!=EINTR)
+                {
+                    proxy->FAIL(false, "poll", "poll failed on GRE packet ring");
+                    break;
+                }
+                continue;
+            }
+
+            // Packets get rewritten where the kernel put them and sent straight out of the block
+            bool ok = true;
+            int left = desc->hdr.bh1.num_pkts;
+            uint8_t *p = (uint8_t*)desc + desc->hdr.bh1.offset_to_first_pkt;
+            while(ok && 0<left)
+            {
+                proxy->epoch.enter(reader);
+                    while(0<left && nbOut<batch)
+                    {
+                        struct tpacket3_hdr *hdr = (struct tpacket3_hdr*)p;
+                        if(hdr->tp_snaplen==hdr->tp_len) forward(p + hdr->tp_net, hdr->tp_snaplen);
+                        p += hdr->tp_next_offset;
+                        --left;
+                    }
+                proxy->epoch.leave(reader);
+                ok = flush();
+            }
+            if(ok==false) break;
+
+            // Hand the block back to the kernel only once nothing points into it anymore
+            __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+            block = (block+1) % GRE_RING_BLOCKS;
         }
+    }
 
-        uint32_t dst;
-        uint32_t src = from.sin_addr.s_addr;
-        uint32_t callId = packet[6] | (((uint32_t)packet[7])<<8);
+    // -----------------------------------------------------------------------
+    void Proxy::GREWorker::runXDP()
+    {
+        uint8_t **frames = new uint8_t*[batch];
+        int *lengths = new int[batch];
+        while(1)
+        {
+            int got = xsk->receive(frames, lengths, batch);
+            if(got<0) break;
 
-        DBG(
-            "GRE thread: GRE data packet from %s, callId = 0x%X",
-            ipToStr(src).c_str(),
-            callId
-        );
+            // The XDP program only lets untagged IPv4 through, so the IP header is right after Ethernet
+            proxy->epoch.enter(reader);
+                for(int i=0; i<got; ++i) forward(frames[i]+ETH_HLEN, lengths[i]-ETH_HLEN);
+            proxy->epoch.leave(reader);
+
+            bool ok = flush();
+            xsk->recycle(got);
+            if(ok==false) break;
+        }
+    }
+
+    // -----------------------------------------------------------------------
+    void Proxy::GREWorker::flushTrunkBuffers(
+        Uring               *uring,
+        std::vector<int>    &bids
+    )
+    {
+        flushTrunk();
+        int n = bids.size();
+        for(int i=0; i<n; ++i) uring->recycle(bids[i]);
+        bids.clear();
+    }
 
-        if(isPacketDumpOn())
+    // -----------------------------------------------------------------------
+    void Proxy::GREWorker::runUring()
+    {
+        Uring *uring = new Uring(proxy);
+        if(uring->open(GRE_URING_BUFFERS, GRE_URING_BUFFERS, GRE_BUFFER_SIZE)==false)
         {
-            DBG("GRE thread: GRE packet dump follows, length = %d", savedN);
-            dumpPacket(buf, savedN);
+            proxy->FAIL(false, 0, "GRE thread %d: couldn't set up io_uring, falling back to recvmmsg", id);
+            delete uring;
+            runSocket();
+            return;
         }
 
-        uint32_t out;
-        CallId realCallId;
-        int dstSocket = -1;
-        bool found = findPeer(&dst, &realCallId, src, callId, &dstSocket, &out);
-        if(found==false) FAIL(false, 0, "GRE thread: peer not found, dropping packet");
-        else
+        // Packets get rewritten in the buffer they came in, which stays out of the ring until sent
+        struct msghdr *msgs = new struct msghdr[GRE_URING_BUFFERS];
+        struct iovec *iovs = new struct iovec[GRE_URING_BUFFERS];
+        struct sockaddr_in *dsts = new struct sockaddr_in[GRE_URING_BUFFERS];
+        memset(msgs, 0, GRE_URING_BUFFERS*sizeof(msgs[0]));
+        for(int i=0; i<GRE_URING_BUFFERS; ++i)
         {
-            struct sockaddr_in to;
-            socklen_t toLen = sizeof(to);
-            memset(&to, 0, toLen);
-            to.sin_family = AF_INET;
-            to.sin_addr.s_addr = dst;
-	    //to.sin_port = IPPROTO_GRE; according to raw(7), but doesn't work
+            msgs[i].msg_name = dsts + i;
+            msgs[i].msg_namelen = sizeof(dsts[i]);
+            msgs[i].msg_iov = iovs + i;
+            msgs[i].msg_iovlen = 1;
+        }
 
-            DBG(
-                "GRE thread: GRE data packet peer is at %s, realCallId = 0x%X",
-                ipToStr(dst).c_str(),
-                realCallId
-            );
+        std::vector<int> trunkBids;
+        uring->prepRecv(rxSocket, GRE_URING_RECV);
+        while(1)
+        {
+            if(uring->enter(1, -1)<0) break;
 
-            packet[6] = (realCallId>>0)&0xFF;
-            packet[7] = (realCallId>>8)&0xFF;
+            // One epoch for everything that completed
+            bool rearm = false;
+            proxy->epoch.enter(reader);
+                struct io_uring_cqe *cqe;
+                while((cqe = uring->peek())!=0)
+                {
+                    uint64_t tag = cqe->user_data;
+                    int res = cqe->res;
+                    uint32_t flags = cqe->flags;
+                    uring->advance();
 
-            DBG(
-                "GRE thread: GRE data packet callId patched from 0x%X to 0x%X",
-                callId,
-                realCallId
-            );
+                    if(tag!=GRE_URING_RECV)
+                    {
+                        if(res<0)
+                        {
+                            errno = -res;
+                            proxy->FAIL(false, "sendmsg", "GRE thread %d: sendmsg failed on GRE socket", id);
+                        }
+                        uring->recycle((int)tag);
+                        continue;
+                    }
 
-            if(0<=dstSocket)
-            {
-                DBG("GRE thread: peer supports PPTP-IN-TCP, wrapping GRE data packet into TCP packet");
-
-                uint8_t wrappedPacket[8192];
-                memcpy(wrappedPacket + 8, packet, n);
-
-                n += 8;
-                wrappedPacket[0] = (n&0xFF);
-                wrappedPacket[1] = (n>>8);
-                wrappedPacket[2] = 0x00;
-                wrappedPacket[3] = 0x01;
-                wrappedPacket[4] = 0x1B;
-                wrappedPacket[5] = 0x2C;
-                wrappedPacket[6] = 0x3D;
-                wrappedPacket[7] = 0x4E;
-
-                uint8_t *p = wrappedPacket;
-                while(n>0)
-                {
-                    int s = write(dstSocket, p, n);
-                    if(0<=s)
+                    if((flags & IORING_CQE_F_MORE)==0) rearm = true;
+                    if((flags & IORING_CQE_F_BUFFER)==0)
                     {
-                        p += s;
-                        n -= s;
+                        if(res<0 && res!=-ENOBUFS)
+                        {
+                            errno = -res;
+                            proxy->FAIL(false, "recv", "GRE thread %d: recv failed on GRE socket", id);
+                        }
+                        continue;
                     }
-                    else
+
+                    int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                    uint8_t *buf = uring->getBuffer(bid);
+                    bool queued = false;
+                    if(20<=res && (buf[0]&0xF0)==0x40)
                     {
-                             if(errno==EINTR)   continue;
-                        else if(errno==EAGAIN)  continue;
-                        else
+                        IPAddr src = ((uint32_t*)(buf+12))[0];
+                        if(proxy->forwardGRE(buf, res, src, dsts+bid))
                         {
-                            FAIL(false, "write", "write failed on TCP socket");
-                            break;
+                            if(dsts[bid].sin_port!=0)
+                            {
+                                // Buffer goes back to the ring once the trunk batch it is in has been sent
+                                if(nbTrunk==batch) flushTrunkBuffers(uring, trunkBids);
+                                trunkOut(buf, res, dsts+bid);
+                                trunkBids.push_back(bid);
+                            }
+                            else
+                            {
+                                iovs[bid].iov_base = buf;
+                                iovs[bid].iov_len = res;
+                                uring->prepSendMsg(txSocket, msgs+bid, bid);
+                            }
+                            queued = true;
                         }
                     }
+                    if(queued==false) uring->recycle(bid);
                 }
-            }
-            else
-            {
-                DBG(
-                    "GRE thread: forwarding GRE data packet from %s to %s via interface %s\n",
-                    ipToStr(src).c_str(),
-                    ipToStr(dst).c_str(),
-                    ipToStr(out).c_str()
-                );
-
-                ((uint16_t*)(buf+ 2))[0] = savedN;  // reset id
-                ((uint16_t*)(buf+ 4))[0] = 0;       // reset id
-                ((uint16_t*)(buf+10))[0] = 0;       // reset checksum
-                ((uint32_t*)(buf+12))[0] = out;     // set expected source
-                ((uint32_t*)(buf+16))[0] = dst;     // set destination
-
-                int count = sendto(
-                    greSocket,
-                    buf,
-                    savedN,
-                    0,
-                    (const sockaddr*)&to,
-                    toLen
-                );
-                if(count!=savedN)
-                {
-                    FAIL(false, "sendto", "sendto failed on GRE socket");
-                    break;
-                }
-            }
+            proxy->epoch.leave(reader);
+            flushTrunkBuffers(uring, trunkBids);
+            if(rearm) uring->prepRecv(rxSocket, GRE_URING_RECV);
         }
     }
+
+#endif
+
+// -----------------------------------------------------------------------
+void Proxy::GREWorker::run()
+{
+    DBGP(
+        "GRE thread %d: up and running -- waiting for GRE packets (%s, batches of %d)",
+        id,
+        fromTrunk ? "UDP trunk" : xsk ? "AF_XDP" : ring ? "mmap ring" : proxy->isUring() ? "io_uring" : "socket",
+        batch
+    );
+
+    if(fromTrunk)
+    {
+        runTrunk();
+        return;
+    }
+
+    #if defined(linux)
+        if(xsk!=0)
+        {
+            runXDP();
+            return;
+        }
+        if(ring!=0)
+        {
+            runRing();
+            return;
+        }
+        if(proxy->isUring())
+        {
+            runUring();
+            return;
+        }
+    #endif
+    runSocket();
 }
 
 // -----------------------------------------------------------------------
-void *Proxy::threadHead(
+void *Proxy::GREWorker::threadHead(
     void    *vp
 )
 {
-    Proxy *proxy = (Proxy*)vp;
-    proxy->greThread();
+    GREWorker *worker = (GREWorker*)vp;
+    worker->run();
     return 0;
 }
 
 // -----------------------------------------------------------------------
-void Proxy::startGREThread()
+void Proxy::GREWorker::start()
+{
+    DBGP("launching GRE thread %d", id);
+    proxy->startThread(threadHead, this, true, "GRE");
+}
+
+// -----------------------------------------------------------------------
+int Proxy::makeGRESocket(
+    bool receive
+)
 {
     int on = 1;
     int solip = SOL_IP;
@@ -216,13 +544,157 @@ void Proxy::startGREThread()
         );
     }
 
+    #if defined(linux)
+        // A send-only socket must still exist for the kernel to consider GRE delivered,
+        // or it answers every packet with a protocol unreachable
+        if(receive==false)
+        {
+            struct sock_filter dropAll[] =
+            {
+                BPF_STMT(BPF_RET | BPF_K, 0),
+            };
+            struct sock_fprog prog;
+            prog.len = sizeof(dropAll)/sizeof(dropAll[0]);
+            prog.filter = dropAll;
+            if(setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))<0)
+            {
+                FAIL(true, "setsockopt", "setsockopt(SO_ATTACH_FILTER) failed on GRE send socket");
+            }
+        }
+    #endif
+
     setNonBlocking(s, false, true);
     DBG("GRE socket sucessfully created (descriptor = %d)", s);
-    greSocket = s;
-
-    pthread_t thread;
-    DBG("launching GRE thread");
-    r = pthread_create(&thread, 0, threadHead, this);
-    if(r<0) FAIL(true, "pthread_create", "couldn't start GRE thread");
+    return s;
 }
 
+// -----------------------------------------------------------------------
+#if defined(linux)
+
+    int Proxy::makeGREListener(
+        int     fanoutId,
+        uint8_t **ring
+    )
+    {
+        int s = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if(s<0) FAIL(true, "socket", "couldn't create packet socket for GRE workers");
+
+        // Only GRE addressed to this host: our own outgoing packets show up here too
+        struct sock_filter greOnly[] =
+        {
+            BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE)),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   PACKET_HOST, 0, 3),
+            BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, 9),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_GRE, 0, 1),
+            BPF_STMT(BPF_RET | BPF_K,             0x40000),
+            BPF_STMT(BPF_RET | BPF_K,             0),
+        };
+        struct sock_fprog prog;
+        prog.len = sizeof(greOnly)/sizeof(greOnly[0]);
+        prog.filter = greOnly;
+        if(setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))<0)
+        {
+            FAIL(true, "setsockopt", "setsockopt(SO_ATTACH_FILTER) failed on packet socket");
+        }
+
+        if(ring!=0)
+        {
+            int version = TPACKET_V3;
+            if(setsockopt(s, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))<0)
+            {
+                FAIL(true, "setsockopt", "setsockopt(PACKET_VERSION) failed, TPACKET_V3 not supported ?");
+            }
+
+            struct tpacket_req3 req;
+            memset(&req, 0, sizeof(req));
+            req.tp_block_size = GRE_RING_BLOCK_SIZE;
+            req.tp_block_nr = GRE_RING_BLOCKS;
+            req.tp_frame_size = GRE_RING_FRAME_SIZE;
+            req.tp_frame_nr = (GRE_RING_BLOCK_SIZE/GRE_RING_FRAME_SIZE)*GRE_RING_BLOCKS;
+            req.tp_retire_blk_tov = GRE_RING_TIMEOUT;
+            if(setsockopt(s, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))<0)
+            {
+                FAIL(true, "setsockopt", "setsockopt(PACKET_RX_RING) failed on packet socket");
+            }
+
+            void *map = mmap(0, GRE_RING_BLOCK_SIZE*GRE_RING_BLOCKS, PROT_READ|PROT_WRITE, MAP_SHARED, s, 0);
+            if(map==MAP_FAILED) FAIL(true, "mmap", "couldn't map GRE packet ring");
+            *ring = (uint8_t*)map;
+        }
+
+        // Protocol 0 at creation and bind once the filter is in, so nothing unfiltered gets queued
+        struct sockaddr_ll addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_protocol = htons(ETH_P_IP);
+        if(bind(s, (struct sockaddr*)&addr, sizeof(addr))<0)
+        {
+            FAIL(true, "bind", "couldn't bind packet socket for GRE workers");
+        }
+
+        // Spread packets by call id, so that a given call always lands on the same worker
+        int fanout = (fanoutId & 0xFFFF) | ((PACKET_FANOUT_CBPF | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+        if(setsockopt(s, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout))<0)
+        {
+            FAIL(true, "setsockopt", "setsockopt(PACKET_FANOUT) failed on packet socket");
+        }
+
+        struct sock_filter byCallId[] =
+        {
+            BPF_STMT(BPF_LDX | BPF_B   | BPF_MSH, 0),
+            BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, 6),
+            BPF_STMT(BPF_ALU | BPF_MUL | BPF_K,   0x9E3779B1),
+            BPF_STMT(BPF_ALU | BPF_RSH | BPF_K,   16),
+            BPF_STMT(BPF_RET | BPF_A,             0),
+        };
+        prog.len = sizeof(byCallId)/sizeof(byCallId[0]);
+        prog.filter = byCallId;
+        if(setsockopt(s, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog))<0)
+        {
+            FAIL(true, "setsockopt", "setsockopt(PACKET_FANOUT_DATA) failed on packet socket");
+        }
+
+        DBG("GRE packet socket sucessfully created (descriptor = %d)", s);
+        return s;
+    }
+
+#endif
+
+// -----------------------------------------------------------------------
+void Proxy::startGREThreads()
+{
+    #if defined(linux)
+        bool fanout = (1<greThreads || greRing);
+    #else
+        bool fanout = false;
+        greThreads = 1;
+        greRing = false;
+    #endif
+
+    // A single worker reads straight from the raw socket, a pool or a ring goes through packet sockets
+    greSocket = makeGRESocket(fanout==false);
+    for(int i=0; i<greThreads; ++i)
+    {
+        int rx = greSocket;
+        int tx = greSocket;
+        uint8_t *ring = 0;
+        #if defined(linux)
+            if(fanout)
+            {
+                rx = makeGREListener(getpid(), greRing ? &ring : 0);
+                if(0<i) tx = makeGRESocket(false);
+            }
+        #endif
+
+        int trunk = trunkPort ? makeTrunkSocket(false) : -1;
+        GREWorker *worker = new GREWorker(this, i, rx, tx, ring, 0, trunk, false);
+        greWorkers.push_back(worker);
+        worker->start();
+    }
+    startTrunk();
+
+    // Established calls are handled in tc, other known calls skip the stack altogether,
+    // everything else still reaches the workers above
+    startOffload();
+    startXDP();
+}
@@ -0,0 +1,199 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// -----------------------------------------------------------------------
+// Servers of pairs that have more than one get a TCP connection attempt every
+// --healthCheck seconds, all of them at once. One that refuses or doesn't answer
+// twice in a row stops getting new links until a probe gets through again.
+
+// Failed probes in a row that take a server out
+#define HEALTH_FALL 2
+
+// -----------------------------------------------------------------------
+Proxy::HealthChecker::HealthChecker(
+    Proxy *_proxy
+)
+    :
+        proxy(_proxy)
+{
+    // A lone server gets the links whatever its health, no point probing it
+    int n = proxy->pairs.size();
+    for(int i=0; i<n; ++i)
+    {
+        Pair *pair = proxy->pairs[i];
+        int nbUpstreams = pair->getNbUpstreams();
+        if(nbUpstreams<=1) continue;
+        for(int j=0; j<nbUpstreams; ++j)
+        {
+            Target target;
+            target.pair = pair;
+            target.upstream = j;
+            targets.push_back(target);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::HealthChecker::record(
+    int     i,
+    bool    ok
+)
+{
+    Pair *pair = targets[i].pair;
+    int j = targets[i].upstream;
+    Pair::Upstream &up = pair->getUpstream(j);
+
+    if(ok)
+    {
+        up.failures = 0;
+        if(pair->isHealthy(j)) return;
+        pair->setHealthy(j, true);
+        proxy->INFO("server %s of %s is back, new links go to it again", up.name, pair->getListenName());
+        return;
+    }
+
+    ++up.failures;
+    if(up.failures<HEALTH_FALL || pair->isHealthy(j)==false) return;
+    pair->setHealthy(j, false);
+    proxy->FAIL(
+        false,
+        0,
+        "server %s of %s failed %d health checks in a row, no new links go to it",
+        up.name,
+        pair->getListenName(),
+        up.failures
+    );
+}
+
+// -----------------------------------------------------------------------
+void Proxy::HealthChecker::probeAll()
+{
+    // Every connect is started before waiting on any of them
+    int n = targets.size();
+    std::vector<struct pollfd> fds(n);
+    int pending = 0;
+    for(int i=0; i<n; ++i)
+    {
+        fds[i].fd = -1;
+        fds[i].events = POLLOUT;
+        fds[i].revents = 0;
+
+        Pair *pair = targets[i].pair;
+        int j = targets[i].upstream;
+        IPAddr addr = pair->getPeerAddr(j);
+        if(addr==INADDR_NONE) continue;
+
+        int s = proxy->makeSocket(SOCK_STREAM, 0, false);
+        if(s<0) continue;
+        if(proxy->setNonBlocking(s, true, false)==false)
+        {
+            close(s);
+            continue;
+        }
+
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = addr;
+        sa.sin_port = (uint16_t)pair->getUpstream(j).port;
+        if(connect(s, (struct sockaddr*)&sa, sizeof(sa))==0)
+        {
+            close(s);
+            record(i, true);
+            continue;
+        }
+        if(errno!=EINPROGRESS)
+        {
+            close(s);
+            record(i, false);
+            continue;
+        }
+        fds[i].fd = s;
+        ++pending;
+    }
+
+    // A server gets as long to answer a probe as it would to answer a client
+    int timeout = proxy->getConnectTimeout();
+    if(proxy->getHealthInterval()<timeout) timeout = proxy->getHealthInterval();
+    uint64_t deadline = proxy->now() + 1000*(uint64_t)timeout;
+    while(0<pending)
+    {
+        uint64_t t = proxy->now();
+        if(deadline<=t) break;
+
+        int r = poll(&fds[0], n, (int)(deadline-t));
+        if(r<0 && errno==EINTR) continue;
+        if(r<=0) break;
+
+        for(int i=0; i<n; ++i)
+        {
+            if(fds[i].fd<0 || fds[i].revents==0) continue;
+
+            int error = 0;
+            socklen_t size = sizeof(error);
+            if(getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &size)<0) error = errno;
+            close(fds[i].fd);
+            fds[i].fd = -1;
+            --pending;
+            record(i, error==0);
+        }
+    }
+
+    // Still connecting means no answer
+    for(int i=0; i<n; ++i)
+    {
+        if(fds[i].fd<0) continue;
+        close(fds[i].fd);
+        record(i, false);
+    }
+}
+
+// -----------------------------------------------------------------------
+void *Proxy::HealthChecker::threadHead(
+    void *vp
+)
+{
+    HealthChecker *checker = (HealthChecker*)vp;
+    checker->run();
+    return 0;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::HealthChecker::run()
+{
+    while(1)
+    {
+        uint64_t start = proxy->now();
+        probeAll();
+
+        uint64_t end = start + 1000*(uint64_t)proxy->getHealthInterval();
+        uint64_t t = proxy->now();
+        if(t<end)
+        {
+            struct timespec ts;
+            ts.tv_sec = (end-t)/1000;
+            ts.tv_nsec = ((end-t)%1000)*1000000;
+            nanosleep(&ts, 0);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::HealthChecker::start()
+{
+    if(targets.empty() || proxy->getHealthInterval()<=0) return;
+
+    DBGP("launching health checks of %d server(s) every %d seconds", (int)targets.size(), proxy->getHealthInterval());
+    if(proxy->startThread(threadHead, this, false, "health check")==false) proxy->INFO("all servers stay in use");
+}
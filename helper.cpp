@@ -0,0 +1,273 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// -----------------------------------------------------------------------
+// Each reactor runs its own copy of the --aclHelper command and keeps talking to it:
+// one IP address per line on its standard input, one verdict per line on its standard
+// output, in the same order. Queries don't wait for earlier answers, and the links
+// they are for stay parked here until theirs comes back.
+
+// A helper that dies sooner than this after being started waits that long to come back
+#define HELPER_RESTART_DELAY    1000
+
+// -----------------------------------------------------------------------
+Proxy::ACLHelper::ACLHelper(
+    Proxy       *_proxy,
+    Reactor     *_reactor,
+    const char  *_cmd
+)
+    :
+        proxy(_proxy),
+        reactor(_reactor),
+        cmd(_cmd),
+        pid(-1),
+        fd(-1),
+        generation(0),
+        startTime(0)
+{
+}
+
+// -----------------------------------------------------------------------
+Proxy::ACLHelper::~ACLHelper()
+{
+    stop();
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::ACLHelper::spawn()
+{
+    // A socket pair rather than pipes: a helper that went away is an error, not a SIGPIPE
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)<0)
+    {
+        proxy->FAIL(false, "socketpair", "couldn't create socket pair for ACL helper %s", cmd);
+        return false;
+    }
+
+    startTime = proxy->now();
+    pid = fork();
+    if(pid<0)
+    {
+        proxy->FAIL(false, "fork", "couldn't start ACL helper %s", cmd);
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    if(pid==0)
+    {
+        // Undo what the proxy set up for itself, the helper starts out like from a shell
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, 0);
+        signal(SIGHUP , SIG_DFL);
+        signal(SIGALRM, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGUSR1, SIG_DFL);
+        signal(SIGUSR2, SIG_DFL);
+
+        dup2(sv[1], 0);
+        dup2(sv[1], 1);
+        long max = sysconf(_SC_OPEN_MAX);
+        if(max<0 || 65536<max) max = 65536;
+        for(int i=3; i<max; ++i) close(i);
+
+        execl("/bin/sh", "sh", "-c", cmd, (char*)0);
+        _exit(127);
+    }
+
+    close(sv[1]);
+    fd = sv[0];
+    proxy->setNonBlocking(fd, true, false);
+    ++generation;
+
+    DBGP(
+        "reactor %d: started ACL helper %s (pid %d)",
+        reactor->getId(),
+        cmd,
+        pid
+    );
+
+    // Whatever the previous one left unanswered gets asked again
+    output.clear();
+    input.clear();
+    int n = queries.size();
+    for(int i=0; i<n; ++i) output += proxy->ipToStr(queries[i].link->getCallerIP()) + "\n";
+    reactor->watchHelper(fd, generation);
+    return flush();
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLHelper::stop()
+{
+    if(pid<0) return;
+
+    // Closing is enough to take the descriptor out of the reactor's epoll set
+    close(fd);
+    fd = -1;
+    kill(pid, SIGKILL);
+
+    int status;
+    while(waitpid(pid, &status, 0)<0 && errno==EINTR) {}
+    pid = -1;
+    output.clear();
+    input.clear();
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::ACLHelper::flush()
+{
+    while(output.empty()==false)
+    {
+        ssize_t r = send(fd, output.data(), output.size(), MSG_NOSIGNAL);
+        if(r<0 && errno==EINTR) continue;
+        if(r<0 && errno==EAGAIN) return true;
+        if(r<0)
+        {
+            proxy->FAIL(false, "send", "couldn't write to ACL helper %s, restarting it", cmd);
+            stop();
+            return false;
+        }
+        output.erase(0, r);
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLHelper::query(
+    Link *link
+)
+{
+    Query q;
+    q.link = link;
+    q.deadline = proxy->now() + 1000*(uint64_t)proxy->getConnectTimeout();
+    queries.push_back(q);
+
+    DBGP(
+        "reactor %d: asking ACL helper about %s (%d queries pending)",
+        reactor->getId(),
+        link->getCallerName(),
+        (int)queries.size()
+    );
+
+    // While the helper is down, the query waits for the next one
+    if(pid<0) return;
+    output += proxy->ipToStr(link->getCallerIP()) + "\n";
+    flush();
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLHelper::readAnswers()
+{
+    if(pid<0) return;
+
+    char buf[4096];
+    while(1)
+    {
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if(r<0 && errno==EINTR) continue;
+        if(r<0 && errno==EAGAIN) break;
+        if(r<=0)
+        {
+            proxy->FAIL(
+                false,
+                r<0 ? "read" : 0,
+                "ACL helper %s went away, restarting it",
+                cmd
+            );
+            stop();
+            return;
+        }
+        input.append(buf, r);
+    }
+
+    // OK lets the connection through, anything else turns it down
+    size_t start = 0;
+    while(1)
+    {
+        size_t end = input.find('\n', start);
+        if(end==std::string::npos) break;
+
+        std::string line = input.substr(start, end-start);
+        start = end+1;
+        if(queries.empty())
+        {
+            proxy->FAIL(false, 0, "ACL helper %s answered '%s' to a question nobody asked", cmd, line.c_str());
+            continue;
+        }
+
+        Link *link = queries.front().link;
+        queries.pop_front();
+
+        bool allowed = (0==line.compare(0, 2, "OK"));
+        proxy->aclCache.store(link->getCallerIP(), allowed, proxy->now());
+        DBGP(
+            "ACL helper says %s for %s",
+            allowed ? "yes" : "no",
+            link->getCallerName()
+        );
+        reactor->aclVerdict(link, allowed);
+    }
+    input.erase(0, start);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::ACLHelper::tick()
+{
+    uint64_t t = proxy->now();
+
+    // A helper that sits on a question for as long as a server may take to answer is stuck
+    if(queries.empty()==false && queries.front().deadline<=t)
+    {
+        proxy->FAIL(
+            false,
+            0,
+            "ACL helper %s didn't answer within %d seconds, restarting it",
+            cmd,
+            proxy->getConnectTimeout()
+        );
+        while(queries.empty()==false && queries.front().deadline<=t)
+        {
+            Link *link = queries.front().link;
+            queries.pop_front();
+            reactor->aclVerdict(link, false);
+        }
+        stop();
+    }
+
+    if(pid<0)
+    {
+        if(generation==0 || startTime+HELPER_RESTART_DELAY<=t) spawn();
+        return;
+    }
+    flush();
+}
+
+// -----------------------------------------------------------------------
+int Proxy::ACLHelper::getTimeout()
+{
+    // How long the reactor may sleep before tick() has something to do
+    uint64_t t = proxy->now();
+    uint64_t wake = 0;
+    if(pid<0)                       wake = startTime + HELPER_RESTART_DELAY;
+    else if(output.empty()==false)  wake = t + 1;
+    if(queries.empty()==false)
+    {
+        uint64_t deadline = queries.front().deadline;
+        if(wake==0 || deadline<wake) wake = deadline;
+    }
+
+    if(wake==0) return -1;
+    return wake<=t ? 0 : (int)(wake-t);
+}
@@ -5,72 +5,79 @@
 
 #include <proxy.h>
 #include <errno.h>
+#include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+// Wrapped GRE frames taken out of a link's ring at once, two iovecs each
+#define WRAP_BATCH  64
+
+// A proxy with a UDP trunk offers it past the PPTP-IN-TCP marker's terminating zero,
+// where proxies that only know about wrapping don't look
+#define TRUNK_OFFER_OFFSET  16
+
 // -----------------------------------------------------------------------
 Proxy::Link::Link(
-    Proxy *_proxy,
-    int   pairIndex
+    Proxy   *_proxy,
+    Reactor *_reactor,
+    int     pairIndex,
+    int     _callerSocket,
+    IPAddr  _callerIP
 )
     :
 
-        pair(_proxy->pairs[pairIndex]),
-        proxy(_proxy),
+        reactor(_reactor),
+        callerSocket(_callerSocket),
+        calleeSocket(-1),
+        dead(false),
+        callerPaused(false),
+        calleePaused(false),
+        state(ACCEPTED),
+        callerEvents(0),
+        calleeEvents(0),
+        drops(0),
+        callerFrames(0),
+        calleeFrames(0),
+        wrapScheduled(0),
 
-        callerIP(~0),
-        callerSocket(-1),
-        realCallerId(~0),
-        fakeCallerId(~0),
+        callerIP(_callerIP),
         callerCanWrap(false),
+        callerTrunkPort(0),
         callerReceivingIP(~0),
 
         calleeIP(~0),
-        calleeSocket(-1),
-        realCalleeId(~0),
-        fakeCalleeId(~0),
-        calleeCanWrap(false)
+        calleeCanWrap(false),
+        calleeTrunkPort(0),
+        calleeLocalIP(0),
+
+        pair(_proxy->pairs[pairIndex]),
+        upstream(-1),
+        proxy(_proxy),
+        index(-1),
+        deadline(0),
+        highWaterHits(0)
 {
+    pthread_mutex_t iLock = PTHREAD_MUTEX_INITIALIZER;
+    ioLock = iLock;
 
+    callerName = proxy->ipToStr(callerIP);
     DBGP(
-        "incoming connection on interface %s",
+        "incoming connection from %s on interface %s",
+        getCallerName(),
         getListenName()
     );
+}
 
-    struct sockaddr_in addr;
-    socklen_t addrLen = sizeof(addr);
-    int listenSocket = pair->getSocket();
-    int tmpSocket = accept(listenSocket,(struct sockaddr*)&addr, &addrLen);
-    if(tmpSocket<0)
-    {
-        proxy->FAIL(
-            false,
-            "accept",
-            "accept failed on listen socket for pair %s -> %s",
-            getListenName(),
-            getPeerName()
-        );
-        return;
-    }
-
-    callerIP = (IPAddr)addr.sin_addr.s_addr;
-    callerName = proxy->ipToStr(callerIP);
-    if(proxy->checkACL(callerIP)==false)
-    {
-        proxy->FAIL(
-            false,
-            0,
-            "unauthorized connection from IP %s",
-            getCallerName()
-        );
-        close(tmpSocket);
-        return;
-    }
-
-    if(proxy->setNonBlocking(tmpSocket, true, false)==false)
+// -----------------------------------------------------------------------
+bool Proxy::Link::start()
+{
+    if(proxy->setNonBlocking(callerSocket, true, false)==false)
     {
         proxy->FAIL(
             false,
@@ -79,12 +86,12 @@ Proxy::Link::Link(
             getCallerName(),
             getPeerName()
         );
-        close(tmpSocket);
-        return;
+        return false;
     }
 
-    addrLen = sizeof(addr);
-    int r = getsockname(tmpSocket, (struct sockaddr*)&addr, &addrLen);
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    int r = getsockname(callerSocket, (struct sockaddr*)&addr, &addrLen);
     if(r<0)
     {
         proxy->FAIL(
@@ -94,53 +101,115 @@ Proxy::Link::Link(
             getCallerName(),
             getPeerName()
         );
-        close(tmpSocket);
-        return;
+        return false;
     }
 
-    callerSocket = tmpSocket;
     callerReceivingIP = (IPAddr)addr.sin_addr.s_addr;
     DBGP("callee connected on local IP %s\n",  proxy->ipToStr(callerReceivingIP).c_str());
 
+    // Without a verdict yet, the reactor's ACL helper gets the last word and connectPeer() waits for it
+    state = ACL_PENDING;
+    bool allowed = false;
+    bool decided = proxy->checkACL(callerIP, &allowed, reactor->getReader());
+    if(decided==false && reactor->queryACL(this)==true) return true;
+    if(allowed) return connectPeer();
+
+    proxy->FAIL(
+        false,
+        0,
+        "unauthorized connection from IP %s",
+        getCallerName()
+    );
+    return false;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::connectPeer()
+{
+    // The resolver may change a server's address at any time, this link sticks to what it read
+    int chosen = pair->pickUpstream(callerIP);
+    IPAddr peerAddr = chosen<0 ? INADDR_NONE : pair->getPeerAddr(chosen);
+    if(peerAddr==INADDR_NONE)
+    {
+        proxy->FAIL(
+            false,
+            0,
+            "no server of %s is resolved yet, dropping link from %s",
+            getPeerName(),
+            getCallerName()
+        );
+        return false;
+    }
+    upstream = chosen;
+    pair->countLink(upstream, 1);
     DBGP("connecting to peer %s", getPeerName());
 
+    struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = pair->getPeerAddr();
-    addr.sin_port = (uint16_t)pair->getPeerPort();
+    addr.sin_addr.s_addr = peerAddr;
+    addr.sin_port = (uint16_t)pair->getUpstream(upstream).port;
 
-    tmpSocket = proxy->makeSocket(SOCK_STREAM, 0, false);
-    if(connect(tmpSocket, (struct sockaddr*)&addr, sizeof(addr))<0)
+    int tmpSocket = proxy->makeSocket(SOCK_STREAM, 0, false);
+    if(tmpSocket<0) return false;
+
+    if(proxy->setNonBlocking(tmpSocket, true, false)==false)
     {
         proxy->FAIL(
             false,
             "connect",
-            "failed to connect to server %s",
+            "setNonBlocking failed on callee socket for link %s -> %s",
+            getCallerName(),
             getPeerName()
         );
-        close(callerSocket);
-        callerSocket = -1;
         close(tmpSocket);
-        return;
+        return false;
     }
 
-    if(proxy->setNonBlocking(tmpSocket, true, false)==false)
+    calleeIP = peerAddr;
+    calleeSocket = tmpSocket;
+    state = CONNECTING;
+    deadline = proxy->now() + 1000*(uint64_t)proxy->getConnectTimeout();
+
+    if(connect(calleeSocket, (struct sockaddr*)&addr, sizeof(addr))<0)
     {
+        if(errno==EINPROGRESS) return true;
         proxy->FAIL(
             false,
             "connect",
-            "setNonBlocking failed on callee socket for link %s -> %s",
-            getCallerName(),
+            "failed to connect to server %s",
             getPeerName()
         );
-        close(callerSocket);
-        callerSocket = -1;
-        close(tmpSocket);
-        return;
+        return false;
     }
 
-    calleeIP = pair->getPeerAddr();
-    calleeSocket = tmpSocket;
+    return finishConnect();
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::finishConnect()
+{
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+    if(getsockopt(calleeSocket, SOL_SOCKET, SO_ERROR, &err, &errLen)<0) err = errno;
+    if(err!=0)
+    {
+        errno = err;
+        proxy->FAIL(
+            false,
+            "connect",
+            "failed to connect to server %s",
+            getPeerName()
+        );
+        return false;
+    }
+
+    state = ESTABLISHED;
+
+    // GRE offloaded to the kernel towards the callee needs an explicit source address
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    if(getsockname(calleeSocket, (struct sockaddr*)&addr, &addrLen)==0) calleeLocalIP = (IPAddr)addr.sin_addr.s_addr;
 
     DBGP(
         "tcp link established %s -> %s",
@@ -154,12 +223,88 @@ Proxy::Link::Link(
         getPeerName(),
         getListenName()
     );
+    return true;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Link::publishCall(
+    const Call  &call,
+    bool        known
+)
+{
+    // Caller holds the DB write lock. GRE from the callee carries the caller's fake id, and vice versa
+    CallIndex::Entry toCaller;
+    memset(&toCaller, 0, sizeof(toCaller));
+    toCaller.src = calleeIP;
+    toCaller.fakeId = call.fakeCallerId;
+    toCaller.dst = callerIP;
+    toCaller.sndAddr = callerReceivingIP;
+    toCaller.realId = call.realCallerId;
+    toCaller.wrapLink = (callerCanWrap && callerTrunkPort==0) ? this : 0;
+    toCaller.wrapToCaller = true;
+    toCaller.trunkPort = callerTrunkPort;
+
+    CallIndex::Entry toCallee;
+    memset(&toCallee, 0, sizeof(toCallee));
+    toCallee.src = callerIP;
+    toCallee.fakeId = call.fakeCalleeId;
+    toCallee.dst = calleeIP;
+    toCallee.sndAddr = 0;
+    toCallee.realId = call.realCalleeId;
+    toCallee.wrapLink = (calleeCanWrap && calleeTrunkPort==0) ? this : 0;
+    toCallee.wrapToCaller = false;
+    toCallee.trunkPort = calleeTrunkPort;
+
+    // Only calls with both ids settled and plain GRE on the way out can be offloaded
+    bool established = known && call.realCallerId!=(CallId)~0 && call.realCalleeId!=(CallId)~0;
+    proxy->publishCall(toCaller, callerReceivingIP, known, established && callerCanWrap==false);
+    proxy->publishCall(toCallee, calleeLocalIP, known, established && calleeCanWrap==false);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Link::releaseCall(
+    int i
+)
+{
+    // Caller holds the DB write lock. Each fake id lives in the space of the peer that sees it
+    publishCall(calls[i], false);
+    proxy->freeCallId(calleeIP, calls[i].fakeCallerId);
+    proxy->freeCallId(callerIP, calls[i].fakeCalleeId);
+    pair->countCall(upstream, -1);
+    calls[i] = calls.back();
+    calls.pop_back();
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Link::releaseCalls()
+{
+    while(calls.empty()==false) releaseCall(calls.size()-1);
+}
+
+// -----------------------------------------------------------------------
+int Proxy::Link::findCall(
+    bool    callerSide,
+    bool    fake,
+    CallId  id
+)
+{
+    // Only ever a handful per link, and only on control messages
+    int n = calls.size();
+    for(int i=0; i<n; ++i)
+    {
+        const Call &call = calls[i];
+        CallId c = callerSide ?
+            (fake ? call.fakeCallerId : call.realCallerId) :
+            (fake ? call.fakeCalleeId : call.realCalleeId);
+        if(c!=(CallId)~0 && (c & 0xFFFF)==id) return i;
+    }
+    return -1;
 }
 
 // -----------------------------------------------------------------------
 Proxy::Link::~Link()
 {
-    bool ok = (0<=callerSocket && 0<=calleeSocket);
+    bool ok = (state==ESTABLISHED);
     if(ok==false)
     {
         DBGP("tearing down stillborn link.");
@@ -172,8 +317,12 @@ Proxy::Link::~Link()
             getPeerName()
         );
     }
-    close(callerSocket);
-    close(calleeSocket);
+    if(0<=callerSocket) close(callerSocket);
+    if(0<=calleeSocket) close(calleeSocket);
+    delete callerFrames;
+    delete calleeFrames;
+    pthread_mutex_destroy(&ioLock);
+    if(0<=upstream) pair->countLink(upstream, -1);
 
     proxy->INFO(
         "end proxy connection from %s to %s",
@@ -182,61 +331,697 @@ Proxy::Link::~Link()
     );
 }
 
+// -----------------------------------------------------------------------
+static int messageSize(
+    const uint8_t *msg
+)
+{
+    if(msg[2]!=0x00) return -1;
+
+    if(
+        msg[4]==0x1A    &&      // Magic
+        msg[5]==0x2B    &&
+        msg[6]==0x3C    &&
+        msg[7]==0x4D
+    )
+    {
+        int size = (msg[0]<<8) | msg[1];        // Standard PPTP: network order
+        return (size<12 || MAX_MESSAGE_SIZE<size) ? -1 : size;
+    }
+
+    if(
+        msg[4]==0x1B    &&      // Magic
+        msg[5]==0x2C    &&
+        msg[6]==0x3D    &&
+        msg[7]==0x4E
+    )
+    {
+        int size = msg[0] | (msg[1]<<8);        // PPTP-IN-TCP: as written by greThread
+        return (size<8 || MAX_MESSAGE_SIZE<size) ? -1 : size;
+    }
+
+    return -1;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::send(
+    bool            toCaller,
+    const uint8_t   *p,
+    int             n
+)
+{
+    if(n<=0) return true;
+    DBGP("forwarding %d bytes of tcp packets to %s", n, toCaller ? "caller" : "callee");
+
+    int dst = toCaller ? callerSocket : calleeSocket;
+    Queue *queue = toCaller ? &callerQueue : &calleeQueue;
+
+    pthread_mutex_lock(&ioLock);
+
+        // Control messages can't be dropped, a link that can't take them any more is done
+        bool ok = true;
+        if(QUEUE_SIZE<queue->getSize()+n)
+        {
+            proxy->FAIL(
+                false,
+                0,
+                "output queue overflow on control socket for pair %s -> %s",
+                pair->getListenName(),
+                pair->getPeerName()
+            );
+            ok = false;
+            n = 0;
+        }
+
+        // With io_uring, everything goes through the queue and out with the reactor's next batch
+        bool direct = (reactor->isUring()==false);
+        while(direct && queue->isEmpty() && 0<n)
+        {
+            int s = write(dst, p, n);
+            if(0<s)
+            {
+                p+=s;
+                n-=s;
+                continue;
+            }
+
+            if(s<0 && errno==EINTR)     continue;
+            if(s<0 && errno==EAGAIN)    break;
+            proxy->FAIL(
+                false,
+                s<0 ? "write" : 0,
+                s<0 ?
+                    "tcp write failed on control socket for pair %s -> %s" :
+                    "wrote 0 bytes on control socket for pair %s -> %s",
+                pair->getListenName(),
+                pair->getPeerName()
+            );
+            ok = false;
+            break;
+        }
+
+        if(ok && 0<n)
+        {
+            queue->push(p, n);
+            ok = updateInterest();
+        }
+
+    pthread_mutex_unlock(&ioLock);
+    return ok;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Link::sendWrapped(
+    bool            toCaller,
+    const uint8_t   *gre,
+    int             n
+)
+{
+    // GRE threads: only the reactor writes to the link's sockets, it gets told once per batch.
+    // The packet is copied into the ring, the caller's buffer is free again on return
+    FrameRing *frames = toCaller ? callerFrames : calleeFrames;
+    bool wasEmpty = false;
+    if(frames==0 || frames->push(gre, n, &wasEmpty)==false)
+    {
+        __atomic_add_fetch(&drops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if(__atomic_exchange_n(&wrapScheduled, 1, __ATOMIC_SEQ_CST)==0) reactor->touchLink(this);
+}
+
+// -----------------------------------------------------------------------
+static void frameHeader(
+    uint8_t *h,
+    int     n
+)
+{
+    n += 8;
+    h[0] = (n&0xFF);
+    h[1] = (n>>8);
+    h[2] = 0x00;
+    h[3] = 0x01;
+    h[4] = 0x1B;
+    h[5] = 0x2C;
+    h[6] = 0x3D;
+    h[7] = 0x4E;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::flushWrapped(
+    bool toCaller
+)
+{
+    // Called with ioLock held and the queue empty: headers and packets go out side by side,
+    // as many frames per writev as there are, whatever doesn't fit ends up in the queue
+    FrameRing *frames = toCaller ? callerFrames : calleeFrames;
+    Queue *queue = toCaller ? &callerQueue : &calleeQueue;
+    int dst = toCaller ? callerSocket : calleeSocket;
+    if(frames==0) return true;
+
+    while(1)
+    {
+        struct iovec packets[WRAP_BATCH];
+        struct iovec iov[2*WRAP_BATCH];
+        uint8_t headers[WRAP_BATCH][8];
+        int nb = frames->peek(packets, WRAP_BATCH);
+        if(nb<=0) return true;
+
+        ssize_t total = 0;
+        for(int i=0; i<nb; ++i)
+        {
+            frameHeader(headers[i], packets[i].iov_len);
+            iov[2*i].iov_base = headers[i];
+            iov[2*i].iov_len = 8;
+            iov[2*i+1] = packets[i];
+            total += 8 + packets[i].iov_len;
+        }
+
+        ssize_t s = writev(dst, iov, 2*nb);
+        if(s<0)
+        {
+            if(errno==EINTR)    continue;
+            if(errno==EAGAIN)   return true;
+            proxy->FAIL(
+                false,
+                "writev",
+                "tcp write failed on control socket for pair %s -> %s",
+                pair->getListenName(),
+                pair->getPeerName()
+            );
+            return false;
+        }
+
+        // A frame cut short must be finished before anything else goes on the stream
+        int done = 0;
+        ssize_t left = s;
+        while(done<nb && (ssize_t)(8+iov[2*done+1].iov_len)<=left) left -= 8 + iov[2*done++ +1].iov_len;
+        if(done<nb && 0<left)
+        {
+            if(left<8) queue->push(headers[done]+left, 8-left);
+            ssize_t skip = (left<8) ? 0 : left-8;
+            queue->push((uint8_t*)packets[done].iov_base+skip, packets[done].iov_len-skip);
+            ++done;
+        }
+        frames->consume(done);
+        if(s<total) return true;
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Link::drainWrapped(
+    bool toCaller
+)
+{
+    // io_uring: frames join the queue, as far as it takes data, and go out with the next send
+    FrameRing *frames = toCaller ? callerFrames : calleeFrames;
+    Queue *queue = toCaller ? &callerQueue : &calleeQueue;
+    if(frames==0) return;
+
+    pthread_mutex_lock(&ioLock);
+        struct iovec packets[WRAP_BATCH];
+        int nb = frames->peek(packets, WRAP_BATCH);
+        int done = 0;
+        while(done<nb && queue->getSize()+8+(int)packets[done].iov_len<=QUEUE_HIGH_WATER)
+        {
+            uint8_t header[8];
+            frameHeader(header, packets[done].iov_len);
+            queue->push(header, 8);
+            queue->push((uint8_t*)packets[done].iov_base, packets[done].iov_len);
+            ++done;
+        }
+        frames->consume(done);
+    pthread_mutex_unlock(&ioLock);
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::flushQueue(
+    bool toCaller
+)
+{
+    int dst = toCaller ? callerSocket : calleeSocket;
+    Queue *queue = toCaller ? &callerQueue : &calleeQueue;
+
+    pthread_mutex_lock(&ioLock);
+        bool ok = (0<=queue->flush(dst));
+        if(ok && queue->isEmpty()) ok = flushWrapped(toCaller);
+        if(ok==false)
+        {
+            proxy->FAIL(
+                false,
+                "writev",
+                "tcp write failed on control socket for pair %s -> %s",
+                pair->getListenName(),
+                pair->getPeerName()
+            );
+        }
+        else
+        {
+            ok = updateInterest();
+        }
+    pthread_mutex_unlock(&ioLock);
+    return ok;
+}
+
+// -----------------------------------------------------------------------
+uint32_t Proxy::Link::wantedEvents(
+    bool callerSide
+)
+{
+    if(state==CONNECTING) return callerSide ? EPOLLRDHUP : EPOLLOUT;
+
+    bool paused = callerSide ? callerPaused : calleePaused;
+    Queue *queue = callerSide ? &callerQueue : &calleeQueue;
+
+    FrameRing *frames = callerSide ? callerFrames : calleeFrames;
+
+    uint32_t events = EPOLLPRI;
+    if(paused==false)                       events |= EPOLLIN;
+    if(queue->isEmpty()==false)             events |= EPOLLOUT;
+    if(frames && frames->isEmpty()==false)  events |= EPOLLOUT;
+    return events;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::updateInterest()
+{
+    // Stop reading from one side while the other one can't keep up
+    int callerQueued = callerQueue.getSize();
+    int calleeQueued = calleeQueue.getSize();
+    if(callerPaused==false && QUEUE_HIGH_WATER<calleeQueued)
+    {
+        callerPaused = true;
+        ++highWaterHits;
+    }
+    if(calleePaused==false && QUEUE_HIGH_WATER<callerQueued)
+    {
+        calleePaused = true;
+        ++highWaterHits;
+    }
+    if(callerPaused==true && calleeQueued<QUEUE_LOW_WATER) callerPaused = false;
+    if(calleePaused==true && callerQueued<QUEUE_LOW_WATER) calleePaused = false;
+
+    // The ring is only ever touched by the reactor thread, which sorts it out at the end of its tick
+    if(reactor->isUring())
+    {
+        reactor->touchLink(this);
+        return true;
+    }
+
+    // Nothing is ever watched with an empty mask, so 0 means not registered yet
+    bool ok = true;
+    uint32_t e1 = wantedEvents(true);
+    uint32_t e2 = wantedEvents(false);
+    if(e1!=callerEvents)
+    {
+        int op = callerEvents==0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        ok = ok && reactor->watchSocket(op, callerSocket, e1, (uint64_t)callerSocket);
+        callerEvents = e1;
+    }
+    if(e2!=calleeEvents)
+    {
+        int op = calleeEvents==0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        ok = ok && reactor->watchSocket(op, calleeSocket, e2, (uint64_t)calleeSocket);
+        calleeEvents = e2;
+    }
+    return ok;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::refreshInterest()
+{
+    pthread_mutex_lock(&ioLock);
+        bool ok = updateInterest();
+    pthread_mutex_unlock(&ioLock);
+    return ok;
+}
+
 // -----------------------------------------------------------------------
 bool Proxy::Link::tcpPacket(
     bool callerPacket
 )
 {
-    int src = getCalleeSocket();
-    int dst = getCallerSocket();
-    if(callerPacket)
+    int src = callerPacket ? getCallerSocket() : getCalleeSocket();
+    std::string *partial = callerPacket ? &callerPartial : &calleePartial;
+
+    uint8_t *buf = reactor->getControlBuffer();
+    while(1)
     {
-        int t = src;
-        src = dst;
-        dst = t;
+        // Never read more than the other side can absorb: what's left stays in the kernel
+        int room = readRoom(callerPacket);
+
+        // Only the unfinished tail of the previous read ever gets copied around
+        int kept = partial->size();
+        room -= kept;
+        if(room<=0) break;
+        if(0<kept) memcpy(buf, partial->data(), kept);
+        if(CONTROL_BUFFER_SIZE-kept<room) room = CONTROL_BUFFER_SIZE-kept;
+
+        int n = read(src, buf+kept, room);
+        if(n==0)
+        {
+            DBGP(
+                "EOF condition on control socket for link %s -> %s",
+                proxy->ipToStr(callerIP).c_str(),
+                pair->getPeerName()
+            );
+            return false;
+        }
+        else if(n<0)
+        {
+            if(errno==EINTR) continue;
+            if(errno==EAGAIN) break;
+            proxy->FAIL(
+                false,
+                "read",
+                "tcp read failed on control socket for link %s -> %s",
+                proxy->ipToStr(callerIP).c_str(),
+                pair->getPeerName()
+            );
+            return false;
+        }
+
+        n += kept;
+        int done = processMessages(callerPacket, buf, n);
+        if(done<0) return false;
+        partial->assign((const char*)(buf+done), n-done);
     }
 
-    uint8_t buf[4096];
-    int n = read(src, buf, 4096);
-    if(n==0)
+    pthread_mutex_lock(&ioLock);
+        bool ok = updateInterest();
+    pthread_mutex_unlock(&ioLock);
+    return ok;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::Link::readRoom(
+    bool callerPacket
+)
+{
+    Queue *dstQueue = callerPacket ? &calleeQueue : &callerQueue;
+    pthread_mutex_lock(&ioLock);
+        bool paused = callerPacket ? callerPaused : calleePaused;
+        int room = QUEUE_SIZE - dstQueue->getSize();
+    pthread_mutex_unlock(&ioLock);
+    return paused ? 0 : room;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::Link::processMessages(
+    bool    callerPacket,
+    uint8_t *buf,
+    int     n
+)
+{
+    // Returns how much of buf was consumed: complete messages only, -1 kills the link
+    int done = 0;
+    int pending = 0;
+    while(8<=n-done)
     {
-        DBGP(
-            "EOF condition on control socket for link %s -> %s",
-            proxy->ipToStr(callerIP).c_str(),
-            pair->getPeerName()
+        uint8_t *msg = buf + done;
+        int size = messageSize(msg);
+        if(size<0)
+        {
+            proxy->FAIL(
+                false,
+                0,
+                "dropping link: lost PPTP framing on control socket for link %s %s %s",
+                getCallerName(),
+                callerPacket ? "->" : "<-",
+                getPeerName()
+            );
+            done = -1;
+            break;
+        }
+        if(n-done<size) break;
+
+        bool forward = true;
+        bool ok = controlMessage(callerPacket, msg, size, &forward);
+        if(ok && forward==false)
+        {
+            ok = send(!callerPacket, buf+pending, done-pending);
+            pending = done + size;
+        }
+        if(ok==false)
+        {
+            done = -1;
+            break;
+        }
+        done += size;
+    }
+
+    // Unwrapped frames still point into buf: out they go, all in one batch
+    reactor->flushGRE();
+    if(0<=done && send(!callerPacket, buf+pending, done-pending)==false) return -1;
+    return done;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::tcpData(
+    bool    callerPacket,
+    uint8_t *p,
+    int     n
+)
+{
+    // io_uring flavour of tcpPacket: the bytes were already read, into one of the ring's buffers
+    std::string *partial = callerPacket ? &callerPartial : &calleePartial;
+    if(partial->empty() && 0<n)
+    {
+        // Nothing held back: parse in place, keep only what can't go out yet
+        int done = 0;
+        if(n<=readRoom(callerPacket)) done = processMessages(callerPacket, p, n);
+        if(done<0) return false;
+        partial->assign((const char*)(p+done), n-done);
+        return true;
+    }
+    if(0<n) partial->append((const char*)p, n);
+
+    // Backlog, as far as the other side can take it
+    uint8_t *buf = reactor->getControlBuffer();
+    while(1)
+    {
+        int len = partial->size();
+        int room = readRoom(callerPacket);
+        if(room<len) len = room;
+        if(CONTROL_BUFFER_SIZE<len) len = CONTROL_BUFFER_SIZE;
+
+        const uint8_t *head = (const uint8_t*)partial->data();
+        int size = (8<=len) ? messageSize(head) : 0;
+        if(len<8 || len<size) break;
+
+        memcpy(buf, head, len);
+        int done = processMessages(callerPacket, buf, len);
+        if(done<0) return false;
+        if(done==0) break;
+        partial->erase(0, done);
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::sent(
+    bool    toCaller,
+    int     n
+)
+{
+    Queue *queue = toCaller ? &callerQueue : &calleeQueue;
+    pthread_mutex_lock(&ioLock);
+        queue->consume(n);
+        bool ok = updateInterest();
+    pthread_mutex_unlock(&ioLock);
+    return ok;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::Link::peekQueue(
+    bool                toCaller,
+    struct iovec        *iov
+)
+{
+    Queue *queue = toCaller ? &callerQueue : &calleeQueue;
+    pthread_mutex_lock(&ioLock);
+        int n = queue->peek(iov);
+    pthread_mutex_unlock(&ioLock);
+    return n;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Link::getQueued(
+    int *toCaller,
+    int *toCallee
+)
+{
+    // Any thread: the queues belong to whoever holds ioLock
+    pthread_mutex_lock(&ioLock);
+        toCaller[0] = callerQueue.getSize();
+        toCallee[0] = calleeQueue.getSize();
+    pthread_mutex_unlock(&ioLock);
+}
+
+// -----------------------------------------------------------------------
+uint32_t Proxy::Link::pollEvents(
+    bool callerSide
+)
+{
+    pthread_mutex_lock(&ioLock);
+        uint32_t events = wantedEvents(callerSide);
+    pthread_mutex_unlock(&ioLock);
+    return events;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::remapId(
+    bool    callerPacket,
+    bool    ownId,
+    CallId  *id
+)
+{
+    // An own id is real on the sender's side and fake beyond, a peer id the other way around
+    bool callerCall = (callerPacket==ownId);
+    int i = findCall(callerCall, ownId==false, *id);
+    if(i<0)
+    {
+        proxy->FAIL(
+            false,
+            0,
+            "failed to map %s id 0x%X for control packet from %s on link %s -> %s",
+            ownId ? "own" : "peer",
+            *id,
+            callerPacket ? "caller" : "callee",
+            getCallerName(),
+            getPeerName()
         );
         return false;
     }
-    else if(n<0)
+
+    const Call &call = calls[i];
+    CallId to = callerCall ?
+        (ownId ? call.fakeCallerId : call.realCallerId) :
+        (ownId ? call.fakeCalleeId : call.realCalleeId);
+
+    DBGP(
+        "successfully mapped %s id 0x%X to 0x%X for control packet",
+        ownId ? "own" : "peer",
+        *id,
+        to
+    );
+    *id = to;
+    return true;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::outgoingCall(
+    bool    callerPacket,
+    uint8_t *msg,
+    int     size
+)
+{
+    // OCRQ opens a call, OCRP names the call it answers by the fake id its sender was given
+    bool reply = (msg[9]==0x08);
+    CallId id = msg[12] | (((uint16_t)msg[13])<<8);
+    CallId serial = msg[14] | (((uint16_t)msg[15])<<8);
+    int i = reply ? findCall(callerPacket==false, true, serial) : -1;
+    if(reply && i<0)
     {
-        if(errno==EINTR) return true;
-        if(errno==EAGAIN) return true;
         proxy->FAIL(
             false,
-            "read",
-            "tcp read failed on control socket for link %s -> %s",
-            proxy->ipToStr(callerIP).c_str(),
-            pair->getPeerName()
+            0,
+            "no call with id 0x%X for reply from %s on link %s -> %s",
+            serial,
+            callerPacket ? "caller" : "callee",
+            getCallerName(),
+            getPeerName()
+        );
+        return true;
+    }
+
+    // The fake id goes to the other side, so it comes out of that side's space
+    IPAddr peer = callerPacket ? calleeIP : callerIP;
+    CallId fakeId;
+    CallId peerId;
+    proxy->enterDBReadWrite();
+        if(reply==false)
+        {
+            // A request reusing an id replaces whatever call still had it
+            i = findCall(callerPacket, false, id);
+            if(0<=i) releaseCall(i);
+
+            Call fresh;
+            fresh.realCallerId = fresh.fakeCallerId = ~0;
+            fresh.realCalleeId = fresh.fakeCalleeId = ~0;
+            calls.push_back(fresh);
+            pair->countCall(upstream, 1);
+            i = calls.size()-1;
+        }
+
+        Call &call = calls[i];
+        CallId *real = callerPacket ? &call.realCallerId : &call.realCalleeId;
+        CallId *fake = callerPacket ? &call.fakeCallerId : &call.fakeCalleeId;
+        publishCall(call, false);
+        proxy->freeCallId(peer, *fake);
+        *real = id;
+        *fake = fakeId = proxy->allocCallId(peer);
+        peerId = callerPacket ? call.realCalleeId : call.realCallerId;
+
+        // A refused call ends right here, no CDN follows
+        bool refused = reply && 16<size && msg[16]!=1;
+        if(fakeId==(CallId)~0 || refused)   releaseCall(i);
+        else                                publishCall(call, true);
+    proxy->leaveDBReadWrite();
+
+    if(fakeId==(CallId)~0)
+    {
+        proxy->FAIL(
+            false,
+            0,
+            "dropping link: no call id left for peer %s",
+            proxy->ipToStr(peer).c_str()
         );
         return false;
     }
+    msg[12] = (fakeId>>0)&0xFF;
+    msg[13] = (fakeId>>8)&0xFF;
 
+    DBGP(
+        "id remapping complete: realCallId = 0x%X, fakeCallId = 0x%X %s = 0x%X, %d calls on link",
+        id,
+        fakeId,
+        reply ? "peerId" : "serial",
+        serial,
+        (int)calls.size()
+    );
+
+    if(reply)
+    {
+        msg[14] = (peerId>>0)&0xFF;
+        msg[15] = (peerId>>8)&0xFF;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Link::controlMessage(
+    bool    callerPacket,
+    uint8_t *msg,
+    int     size,
+    bool    *forward
+)
+{
     DBGP(
         "incoming tcp packet, type 0x%X on link %s %s %s",
-        buf[9],
+        msg[9],
         proxy->ipToStr(callerIP).c_str(),
         callerPacket ? "->" : "<-",
         pair->getPeerName()
     );
-    proxy->dumpPacket(buf, n);
+    proxy->dumpPacket(msg, size);
 
     if(
-        buf[2]==0x00    &&      // Control packet
-        buf[3]==0x01    &&
-        buf[4]==0x1B    &&      // Magic
-        buf[5]==0x2C    &&
-        buf[6]==0x3D    &&
-        buf[7]==0x4E
+        msg[2]==0x00    &&      // Control packet
+        msg[3]==0x01    &&
+        msg[4]==0x1B    &&      // Magic
+        msg[5]==0x2C    &&
+        msg[6]==0x3D    &&
+        msg[7]==0x4E
     )
     {
         DBGP("tcp packet: PPTP-IN-TCP packet");
@@ -273,41 +1058,42 @@ bool Proxy::Link::tcpPacket(
             (callerPacket==false && callerCanWrap==false)
         )
         {
-            uint8_t *grePacket = 8 + buf;
+            DBGP("tcp packet: peer can't unwrap, sending PPTP-IN-TCP packet out as GRE");
+            reactor->unwrapGRE(callerPacket ? callerIP : calleeIP, msg+8, size-8);
+            forward[0] = false;
         }
     }
     else if(
-        buf[2]==0x00    &&      // Control packet
-        buf[3]==0x01    &&
-        buf[4]==0x1A    &&      // Magic
-        buf[5]==0x2B    &&
-        buf[6]==0x3C    &&
-        buf[7]==0x4D
+        msg[2]==0x00    &&      // Control packet
+        msg[3]==0x01    &&
+        msg[4]==0x1A    &&      // Magic
+        msg[5]==0x2B    &&
+        msg[6]==0x3C    &&
+        msg[7]==0x4D
     )
     {
         if(
-	    buf[8]==0x00        &&
+	    msg[8]==0x00        &&
 	    (
-	        buf[9]==0x01    ||    // Start control connection request
-	        buf[9]==0x02          // Start control connection reply
+	        msg[9]==0x01    ||    // Start control connection request
+	        msg[9]==0x02          // Start control connection reply
             )
         )
 	{
             DBGP(
                 "start of control connection %s",
-                buf[9]==0x01 ? "request" : "reply"
+                msg[9]==0x01 ? "request" : "reply"
             );
 
-            uint8_t *p = 92+buf;
+            uint8_t *p = 92+msg;
             static const char marker[] = "PPTP-IN-TCP";
-            if(n<156)
+            if(size<156)
 	    {
-                int delta = 156-n;
-                memset(n+buf, 0, delta);
-                n = 156;
+                DBGP("short start of control connection message, leaving it alone");
+                return true;
             }
 
-            if(0==strcmp((const char*)p, marker))
+            if(0==strncmp((const char*)p, marker, 64))
 	    {
                 DBGP(
                     "%s has PPTP-IN-TCP marker",
@@ -316,119 +1102,101 @@ bool Proxy::Link::tcpPacket(
 
                 if(proxy->isWrapAllowed()==true)
                 {
+                    // The ring has to be there before any call of the link gets published
+                    FrameRing **frames = callerPacket ? &callerFrames : &calleeFrames;
+                    if(frames[0]==0) frames[0] = new FrameRing;
                     if(callerPacket)    callerCanWrap = true;
                     else                calleeCanWrap = true;
                 }
+
+                // Only used when we have a trunk of our own to receive the other way
+                char offer[64-TRUNK_OFFER_OFFSET+1];
+                memcpy(offer, p+TRUNK_OFFER_OFFSET, sizeof(offer)-1);
+                offer[sizeof(offer)-1] = 0;
+
+                unsigned int port = 0;
+                if(
+                    proxy->getTrunkPort()!=0                        &&
+                    1==sscanf(offer, "PPTP-IN-UDP:%u", &port)       &&
+                    0<port                                          &&
+                    port<=65535
+                )
+                {
+                    DBGP(
+                        "%s offers a UDP trunk on port %u",
+                        callerPacket ? "caller" : "callee",
+                        port
+                    );
+                    if(callerPacket)    callerTrunkPort = port;
+                    else                calleeTrunkPort = port;
+                }
             }
 
             if(proxy->isWrapAllowed()==true)
             {
                 DBGP(
                     "adding PPTP-IN-TCP marker to packet before forwarding to %s",
-                    callerPacket ? "callee" : "callee"
+                    callerPacket ? "callee" : "caller"
                 );
+
+                // Whatever the previous hop offered is not for the next one to use
+                memset(p, 0, 64);
                 strcpy((char*)p, marker);
+                if(proxy->getTrunkPort()!=0)
+                {
+                    snprintf(
+                        (char*)p+TRUNK_OFFER_OFFSET,
+                        64-TRUNK_OFFER_OFFSET,
+                        "PPTP-IN-UDP:%u",
+                        proxy->getTrunkPort()
+                    );
+                }
             }
 	}
+        else if(size<16)
+        {
+            // Too short to carry a call id
+        }
         else if(
-            buf[8]==0x00        &&
+            msg[8]==0x00        &&
             (
-                buf[9]==0x07    ||      // Outgoing Call request
-                buf[9]==0x08
+                msg[9]==0x07    ||      // Outgoing Call request
+                msg[9]==0x08
             )
         )
         {
-            uint32_t fakeId;
-            uint32_t id = buf[12] | (((uint16_t)buf[13])<<8);
-            uint32_t serial = buf[14] | (((uint16_t)buf[15])<<8);
-            if(callerPacket)
-            {
-                realCallerId = id;
-                fakeCallerId = fakeId = proxy->allocCallerId();
-            }
-            else
-            {
-                realCalleeId = id;
-                fakeCalleeId = fakeId = proxy->allocCalleeId();
-            }
-            buf[12] = (fakeId>>0)&0xFF;
-            buf[13] = (fakeId>>8)&0xFF;
-
-            DBGP(
-                "id remapping complete: realCallId = 0x%X, fakeCallId = 0x%X %s = 0x%X",
-                id,
-                fakeId,
-                buf[9]==0x08 ? "peerId" : "serial",
-                serial
-            );
-
-            if(buf[9]==0x08)
-            {
-                CallId peer = realCallerId;
-                buf[14] = (peer>>0)&0xFF;
-                buf[15] = (peer>>8)&0xFF;
-            }
+            if(outgoingCall(callerPacket, msg, size)==false) return false;
         }
         else if(
-            buf[8]==0x00        &&
+            msg[8]==0x00        &&
             (
-                buf[9]==0x0C    ||      // Call-Clear-Request
-                buf[9]==0x0D    ||      // Call-Disconnect-Notify
-                buf[9]==0x0E    ||      // WAN-Error-Notify
-                buf[9]==0x0F            // Set-Link_Info
+                msg[9]==0x0C    ||      // Call-Clear-Request
+                msg[9]==0x0D    ||      // Call-Disconnect-Notify
+                msg[9]==0x0E    ||      // WAN-Error-Notify
+                msg[9]==0x0F            // Set-Link_Info
             )
         )
         {
-            uint32_t mappedId;
-            uint32_t id = buf[12] | (((uint16_t)buf[13])<<8);
-            if(proxy->remapId(&mappedId, id))
+            // CCRQ and CDN carry the sender's own id, WEN and SLI the id of its peer
+            bool ownId = (msg[9]==0x0C || msg[9]==0x0D);
+            CallId real = msg[12] | (((uint16_t)msg[13])<<8);
+            CallId id = real;
+            if(remapId(callerPacket, ownId, &id))
             {
-                buf[12] = (mappedId>>0)&0xFF;
-                buf[13] = (mappedId>>8)&0xFF;
+                msg[12] = (id>>0)&0xFF;
+                msg[13] = (id>>8)&0xFF;
             }
-        }
-    }
-
-    DBGP("forwarding tcp packet\n");
 
-    uint8_t *p = buf;
-    while(n>0)
-    {
-        int s = write(dst, p, n);
-        if(s==0)
-        {
-            proxy->FAIL(
-                false,
-                0,
-                "wrote 0 bytes on control socket for pair %s -> %s",
-                pair->getListenName(),
-                pair->getPeerName()
-            );
-            return false;
-        }
-        else if(s>0)
-        {
-            p+=s;
-            n-=s;
-        }
-        else
-        {
-            if(errno==EINTR)            continue;
-            else if(errno==EAGAIN)      continue;
-            else
+            // CDN is the last word on a call, whichever side sends it
+            int i = (msg[9]==0x0D) ? findCall(callerPacket, false, real) : -1;
+            if(0<=i)
             {
-                proxy->FAIL(
-                    false,
-                    "write",
-                    "tcp write failed on control socket for pair %s -> %s",
-                    pair->getListenName(),
-                    pair->getPeerName()
-                );
-                return false;
+                proxy->enterDBReadWrite();
+                    releaseCall(i);
+                proxy->leaveDBReadWrite();
             }
         }
     }
 
     return true;
 }
-
@@ -0,0 +1,291 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+
+#if defined(linux)
+
+#include <stddef.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+
+// -----------------------------------------------------------------------
+// tcx attachment (Linux 6.6), not in every copy of the uapi headers yet
+#define TCX_INGRESS_ATTACH  46
+#define OFFLOAD_MAX_CALLS   65536
+
+// Stack layout of the tc program: call key on top, bpf_fib_lookup parameters below it
+#define FIB                 (-8-(int)sizeof(struct bpf_fib_lookup))
+#define FIB_FIELD(f)        (FIB+(int)offsetof(struct bpf_fib_lookup, f))
+
+// -----------------------------------------------------------------------
+int Proxy::offloadProgram()
+{
+    // Established calls get rewritten and sent out right here, anything the program can't
+    // or won't handle continues up the stack to the GRE threads untouched
+    std::vector<struct bpf_insn> prog;
+    std::vector<int> toPass;
+    std::vector<int> toShot;
+
+    int data = offsetof(struct __sk_buff, data);
+    int dataEnd = offsetof(struct __sk_buff, data_end);
+
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0));                 // r6 = skb
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 2, 6, data, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 3, 6, dataEnd, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 14+20+8));            // eth + ip + gre
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 0, 0));
+
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 12, 0));                   // ethertype
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0, htons(ETH_P_IP)));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_B, 4, 2, 14, 0));                   // version, header length
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0, 0x45));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_B, 4, 2, 14+9, 0));                 // protocol
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0, 47));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 14+6, 0));                 // fragment bits
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_AND | BPF_K, 4, 0, 0, htons(0x3FFF)));
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 14+20+2, 0));              // GRE protocol
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0, htons(0x880B)));
+
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 8, 2, 14+12, 0));                // r8 = old source
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 9, 2, 14+16, 0));                // r9 = old destination
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 10, 8, -8, 0));                  // key.src
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 14+20+6, 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 10, 4, -4, 0));                  // key.callId
+
+    bpfLoadMap(prog, 1, offloadMap);
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -8));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 7, 0, 0, 0));                 // r7 = entry
+
+    // Route towards the peer, from the address the proxy uses on that side
+    int n = sizeof(struct bpf_fib_lookup);
+    for(int i=0; i<n; i+=8) prog.push_back(bpfInsn(BPF_ST | BPF_MEM | BPF_DW, 10, 0, FIB+i, 0));
+    prog.push_back(bpfInsn(BPF_ST | BPF_MEM | BPF_B, 10, 0, FIB_FIELD(family), AF_INET));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 1, 6, offsetof(struct __sk_buff, ingress_ifindex), 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 10, 1, FIB_FIELD(ifindex), 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 1, 7, offsetof(OffloadEntry, src), 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 10, 1, FIB_FIELD(ipv4_src), 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 1, 7, offsetof(OffloadEntry, dst), 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 10, 1, FIB_FIELD(ipv4_dst), 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 1, 6, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, FIB));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, n));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, 0));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_fib_lookup));
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 0, 0, 0, 0));                   // no route, no neighbour yet...
+
+    // Checksum first: the helper moves packet data around, so pointers get reloaded after it
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 1, 6, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 2, 0, 0, 14+10));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 3, 8, 0, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 4, 7, offsetof(OffloadEntry, src), 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 5, 0, 0, 4));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_l3_csum_replace));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 1, 6, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 2, 0, 0, 14+10));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 3, 9, 0, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 4, 7, offsetof(OffloadEntry, dst), 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 5, 0, 0, 4));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_l3_csum_replace));
+
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 2, 6, data, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 3, 6, dataEnd, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 14+20+8));
+    toShot.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 0, 0));
+
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 1, 7, offsetof(OffloadEntry, src), 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 2, 1, 14+12, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 1, 7, offsetof(OffloadEntry, dst), 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 2, 1, 14+16, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 1, 7, offsetof(OffloadEntry, callId), 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_H, 2, 1, 14+20+6, 0));
+
+    // New Ethernet header from the lookup, stack reads have to stay aligned
+    int smac = FIB_FIELD(smac);
+    int dmac = FIB_FIELD(dmac);
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 1, 10, dmac, 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_H, 2, 1, 0, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 1, 10, dmac+2, 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 2, 1, 2, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 1, 10, smac, 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 2, 1, 6, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 1, 10, smac+4, 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_H, 2, 1, 10, 0));
+
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 1, 0, 0, 1));
+    prog.push_back(bpfInsn(BPF_STX | BPF_ATOMIC | BPF_DW, 7, 1, offsetof(OffloadEntry, packets), BPF_ADD));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 1, 6, offsetof(struct __sk_buff, len), 0));
+    prog.push_back(bpfInsn(BPF_STX | BPF_ATOMIC | BPF_DW, 7, 1, offsetof(OffloadEntry, bytes), BPF_ADD));
+
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 1, 10, FIB_FIELD(ifindex), 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 2, 0, 0, 0));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    int pass = prog.size();
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, TC_ACT_OK));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    int shot = prog.size();
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, TC_ACT_SHOT));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    n = toPass.size();
+    for(int i=0; i<n; ++i) prog[toPass[i]].off = pass - (toPass[i]+1);
+    n = toShot.size();
+    for(int i=0; i<n; ++i) prog[toShot[i]].off = shot - (toShot[i]+1);
+    return bpfProgLoad(BPF_PROG_TYPE_SCHED_CLS, &prog[0], prog.size(), "pptp_offload");
+}
+
+// -----------------------------------------------------------------------
+void Proxy::startOffload()
+{
+    int n = offloadInterfaces.size();
+    if(n==0) return;
+
+    offloadMap = bpfMapCreate(BPF_MAP_TYPE_HASH, sizeof(CallKey), sizeof(OffloadEntry), OFFLOAD_MAX_CALLS, "pptp_offload");
+    if(offloadMap<0) FAIL(true, 0, "offload needs BPF support, are we root ?");
+
+    int prog = offloadProgram();
+    if(prog<0) FAIL(true, 0, "couldn't build offload program");
+
+    for(int i=0; i<n; ++i)
+    {
+        const char *interface = offloadInterfaces[i];
+        int ifIndex = if_nametoindex(interface);
+        if(ifIndex==0) FAIL(true, "if_nametoindex", "unknown interface %s", interface);
+
+        int link = bpfLinkCreate(prog, ifIndex, TCX_INGRESS_ATTACH, 0);
+        if(link<0) FAIL(true, "bpf", "couldn't attach offload program to interface %s (needs tcx, Linux 6.6)", interface);
+        INFO("GRE rewrite offloaded to tc ingress on %s", interface);
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::publishOffload(
+    IPAddr  src,
+    CallId  fakeId,
+    IPAddr  dst,
+    IPAddr  out,
+    CallId  realId,
+    bool    known,
+    bool    established
+)
+{
+    CallKey key;
+    key.src = src;
+    key.callId = fakeId & 0xFFFF;
+
+    // The kernel needs a concrete source address, without one the call stays in userspace
+    bool offload = (0<=offloadMap && known && established && out!=0 && out!=(IPAddr)~0);
+    if(0<=offloadMap)
+    {
+        bool ok;
+        if(offload)
+        {
+            OffloadEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.dst = dst;
+            entry.src = out;
+            entry.callId = realId & 0xFFFF;
+            ok = bpfMapUpdate(offloadMap, &key, &entry);
+        }
+        else
+        {
+            ok = bpfMapDelete(offloadMap, &key);
+        }
+        if(ok==false)
+        {
+            FAIL(false, "bpf", "couldn't update offload entry for call id 0x%X from %s", fakeId, ipToStr(src).c_str());
+            offload = false;
+        }
+    }
+
+    // Offloaded calls never make it to XDP's users, leave them to the tc program
+    if(0<=xdpCallMap)
+    {
+        uint32_t value = 1;
+        bool redirect = known && offload==false;
+        bool ok = redirect ? bpfMapUpdate(xdpCallMap, &key, &value) : bpfMapDelete(xdpCallMap, &key);
+        if(ok==false)
+        {
+            FAIL(false, "bpf", "couldn't update XDP entry for call id 0x%X from %s", fakeId, ipToStr(src).c_str());
+        }
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::offloadCounters(
+    IPAddr      src,
+    CallId      fakeId,
+    uint64_t    *packets,
+    uint64_t    *bytes
+)
+{
+    if(offloadMap<0 || fakeId==(CallId)~0) return;
+
+    CallKey key;
+    key.src = src;
+    key.callId = fakeId & 0xFFFF;
+
+    OffloadEntry entry;
+    if(bpfMapLookup(offloadMap, &key, &entry))
+    {
+        *packets += entry.packets;
+        *bytes += entry.bytes;
+    }
+}
+
+#else // linux
+
+// -----------------------------------------------------------------------
+void Proxy::startOffload()
+{
+}
+
+// -----------------------------------------------------------------------
+void Proxy::publishOffload(
+    IPAddr,
+    CallId,
+    IPAddr,
+    IPAddr,
+    CallId,
+    bool,
+    bool
+)
+{
+}
+
+// -----------------------------------------------------------------------
+void Proxy::offloadCounters(
+    IPAddr,
+    CallId,
+    uint64_t*,
+    uint64_t*
+)
+{
+}
+
+#endif // linux
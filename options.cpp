@@ -28,13 +28,32 @@ static void help(
         "        -e, --extensive                Dump all packets seen\n"
         "        -l, --log logFile              Log output to logFile\n"
         "        -c, --codeLocDebug             Include code locations in debug output\n"
+        "        -E, --edgeTriggered            Use edge-triggered epoll notifications\n"
         "        -a, --acl subnet/mask          Add subnet to access control list.\n"
+        "        -A, --aclFile path             Load allow/deny prefixes from path (reloaded on SIGHUP)\n"
+        "                                       Unlisted IPs are refused, unless path is the only ACL and has no allow\n"
         "        -x, --aclCmd external command  Launch an external command to verify ACL\n"
+        "        -H, --aclHelper command        Keep command running and ask it about IPs not in the ACL\n"
+        "        -s, --aclCacheSize count       Remember up to count verdicts of -x and -H (default 4096, 0: none)\n"
+        "        -T, --aclCacheTTL secs[,secs]  Keep approvals[,refusals] that long (default 300,30)\n"
+        "        -t, --connectTimeout seconds   Give up on unresponsive servers after that long (default 15)\n"
+        "        -r, --reactors count           Spread TCP connections over count threads (0: one per CPU)\n"
+        "        -b, --greBatch count           Move up to count GRE packets per system call (default 32)\n"
+        "        -g, --greThreads count         Forward GRE packets with count threads (0: one per CPU)\n"
+        "        -R, --greRing                  Receive GRE packets through a memory-mapped ring\n"
+        "        -X, --xdp interface            Pull GRE for known calls off interface with AF_XDP\n"
+        "        -O, --offload interface        Rewrite GRE of established calls in tc on interface\n"
+        "        -U, --uring                    Do TCP and GRE I/O through io_uring (falls back to epoll)\n"
+        "        -u, --udpTrunk port            Offer chained proxies to carry GRE over UDP on port\n"
+        "        -D, --dnsRefresh seconds       Look peer names up again that often when DNS gives no TTL (default 300, 0: never)\n"
+        "        -B, --balance rr|least|hash    Spread the following pairs' connections over their servers (default rr)\n"
+        "        -C, --healthCheck seconds      Probe the servers of pairs that have several that often (default 10, 0: never)\n"
         "\n"
-        "        -p, --proxy [listen[:listenPort],]remote[:remotePort]\n"
+        "        -p, --proxy [listen[:listenPort],]remote[:remotePort][,remote[:remotePort]...]\n"
         "\n"
         "           Forwards incoming PPTP connections received on TCP address\n"
-        "           <listen:listenPort> to remote PPTP server <remote:remotePort>.\n"
+        "           <listen:listenPort> to remote PPTP server <remote:remotePort>,\n"
+        "           or to one of several remote servers (listen address required then).\n"
         "\n"
         "    Example:\n"
         "\n"
@@ -55,6 +74,139 @@ static void version()
     );
 }
 
+// -----------------------------------------------------------------------
+void Proxy::setConnectTimeout(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --connectTimeout");
+    if(1!=sscanf(arg, "%d", &connectTimeout) || connectTimeout<=0)
+    {
+        FAIL(true, 0, "invalid connect timeout %s, should be a number of seconds", arg);
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::setReactors(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --reactors");
+    if(1!=sscanf(arg, "%d", &nbReactors) || nbReactors<0)
+    {
+        FAIL(true, 0, "invalid reactor count %s", arg);
+    }
+
+    if(nbReactors==0)
+    {
+        long nbCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+        nbReactors = nbCPUs<1 ? 1 : (int)nbCPUs;
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::setGREBatch(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --greBatch");
+    if(1!=sscanf(arg, "%d", &greBatch) || greBatch<=0 || MAX_GRE_BATCH<greBatch)
+    {
+        FAIL(true, 0, "invalid GRE batch size %s, should be between 1 and %d", arg, MAX_GRE_BATCH);
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::setGREThreads(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --greThreads");
+    if(1!=sscanf(arg, "%d", &greThreads) || greThreads<0)
+    {
+        FAIL(true, 0, "invalid GRE thread count %s", arg);
+    }
+
+    if(greThreads==0)
+    {
+        long nbCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+        greThreads = nbCPUs<1 ? 1 : (int)nbCPUs;
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::addXDPInterface(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --xdp");
+    #if !defined(linux)
+        FAIL(true, 0, "--xdp is only supported on Linux");
+    #endif
+    xdpInterfaces.push_back(arg);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::addOffloadInterface(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --offload");
+    #if !defined(linux)
+        FAIL(true, 0, "--offload is only supported on Linux");
+    #endif
+    offloadInterfaces.push_back(arg);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::setTrunkPort(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --udpTrunk");
+    if(1!=sscanf(arg, "%u", &trunkPort) || trunkPort==0 || 65535<trunkPort)
+    {
+        FAIL(true, 0, "invalid UDP trunk port %s", arg);
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::setDNSRefresh(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --dnsRefresh");
+    if(1!=sscanf(arg, "%d", &dnsRefresh) || dnsRefresh<0)
+    {
+        FAIL(true, 0, "invalid DNS refresh interval %s, should be a number of seconds", arg);
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::setBalance(
+    const char *arg
+)
+{
+    // Applies to the pairs that come after it on the command line
+    if(arg==0) FAIL(true, 0, "empty argument for --balance");
+         if(0==strcmp(arg, "rr"))       balance = Pair::ROUND_ROBIN;
+    else if(0==strcmp(arg, "least"))    balance = Pair::LEAST_CALLS;
+    else if(0==strcmp(arg, "hash"))     balance = Pair::SOURCE_HASH;
+    else FAIL(true, 0, "invalid balancing policy %s, should be rr, least or hash", arg);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::setHealthInterval(
+    const char *arg
+)
+{
+    if(arg==0) FAIL(true, 0, "empty argument for --healthCheck");
+    if(1!=sscanf(arg, "%d", &healthInterval) || healthInterval<0)
+    {
+        FAIL(true, 0, "invalid health check interval %s, should be a number of seconds", arg);
+    }
+}
+
 // -----------------------------------------------------------------------
 void Proxy::options(
     char **argv
@@ -74,10 +226,27 @@ void Proxy::options(
         else if(0==strcmp(arg,"-n") || 0==strcmp(arg,"--nofork"))       noFork = true;
         else if(0==strcmp(arg,"-c") || 0==strcmp(arg,"--codeLocDebug")) codeDebug = true;
         else if(0==strcmp(arg,"-e") || 0==strcmp(arg,"--extensive"))    packetDump = true;
+        else if(0==strcmp(arg,"-E") || 0==strcmp(arg,"--edgeTriggered")) edgeTriggered = true;
         else if(0==strcmp(arg,"-a") || 0==strcmp(arg,"--acl"))          addACL(argv ? *++argv : 0);
         else if(0==strcmp(arg,"-l") || 0==strcmp(arg,"--log"))          logFile = (argv ? *++argv : 0);
         else if(0==strcmp(arg,"-p") || 0==strcmp(arg,"--proxy"))        addProxyPair(argv ? *++argv : 0);
         else if(0==strcmp(arg,"-x") || 0==strcmp(arg,"--exec"))         addACLCommand(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-A") || 0==strcmp(arg,"--aclFile"))      setACLFile(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-H") || 0==strcmp(arg,"--aclHelper"))    setACLHelper(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-s") || 0==strcmp(arg,"--aclCacheSize")) setACLCacheSize(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-T") || 0==strcmp(arg,"--aclCacheTTL"))  setACLCacheTTL(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-t") || 0==strcmp(arg,"--connectTimeout")) setConnectTimeout(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-r") || 0==strcmp(arg,"--reactors"))     setReactors(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-b") || 0==strcmp(arg,"--greBatch"))      setGREBatch(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-g") || 0==strcmp(arg,"--greThreads"))    setGREThreads(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-R") || 0==strcmp(arg,"--greRing"))       greRing = true;
+        else if(0==strcmp(arg,"-U") || 0==strcmp(arg,"--uring"))         uring = true;
+        else if(0==strcmp(arg,"-X") || 0==strcmp(arg,"--xdp"))           addXDPInterface(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-O") || 0==strcmp(arg,"--offload"))       addOffloadInterface(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-u") || 0==strcmp(arg,"--udpTrunk"))      setTrunkPort(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-D") || 0==strcmp(arg,"--dnsRefresh"))    setDNSRefresh(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-B") || 0==strcmp(arg,"--balance"))       setBalance(argv ? *++argv : 0);
+        else if(0==strcmp(arg,"-C") || 0==strcmp(arg,"--healthCheck"))   setHealthInterval(argv ? *++argv : 0);
         else
         {
             FAIL(false, 0, "unknown argument %s", *argv);
@@ -85,15 +254,19 @@ void Proxy::options(
         }
     }
 
+    if(trunkPort!=0 && wrap==false) FAIL(true, 0, "--udpTrunk is negotiated like PPTP-IN-TCP and can't be used with --forceStd");
     if(isPacketDumpOn()) debug = true;
     if(isDebugOn()) noFork = true;
 
-    if(aclCmds.size()<=0 && acls.size()<=0)
+    if(aclCmds.size()<=0 && acls.size()<=0 && aclPrefixes.size()<=0 && aclFile==0 && aclHelper==0)
     {
         DBG("no acl specified, forcing 0/0 (all allowed)");
         addACL("0/0");
     }
 
+    // A file that is the only ACL and only rejects doesn't lock everybody else out
+    if(aclCmds.size()<=0 && acls.size()<=0 && aclPrefixes.size()<=0 && aclFile!=0 && aclHelper==0) aclFileDefault = true;
+
     if(pairs.size()<=0)
     {
         help(false);
@@ -6,6 +6,7 @@
 #include <proxy.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -14,7 +15,8 @@
 bool Proxy::parseAddress(
     IPAddr      *addr,
     TCPPort     *port,
-    const char  *istr
+    const char  *istr,
+    char        **host
 )
 {
     char *p;
@@ -40,6 +42,16 @@ bool Proxy::parseAddress(
     }
 
     *port = htons((uint16_t)*port);
+
+    // Names the caller can wait for are left to the resolver, numbers are taken as they are
+    struct in_addr a;
+    if(host!=0 && inet_pton(AF_INET, str, &a)!=1 && str[strspn(str, "0123456789")]!=0)
+    {
+        host[0] = str;
+        addr[0] = INADDR_NONE;
+        return true;
+    }
+
     bool ret = resolve(addr, str, false);
     free(str);
     return ret;
@@ -84,17 +96,48 @@ void Proxy::addProxyPair(
         return;
     }
 
-    IPAddr peerAddr;
-    TCPPort peerPort;
-    if(parseAddress(&peerAddr, &peerPort, peer)==false)
+    // Everything after the listen address is a server to spread connections over
+    std::vector<Pair::Upstream> upstreams;
+    char *list = strdup(peer);
+    char *next = list;
+    while(next!=0)
+    {
+        Pair::Upstream up;
+        memset(&up, 0, sizeof(up));
+        up.name = next;
+        next = strchr(next, ',');
+        if(next!=0) *(next++) = 0;
+
+        char *host = 0;
+        if(parseAddress(&up.addr, &up.port, up.name, &host)==false)
+        {
+            FAIL(
+                false,
+                0,
+                "specified pair %s -> %s will be ignored because peer address %s can not be resolved.",
+                listen,
+                peer,
+                up.name
+            );
+            free(list);
+            return;
+        }
+        up.host = host;
+        up.healthy = 1;
+        upstreams.push_back(up);
+    }
+
+    if(MAX_UPSTREAMS<(int)upstreams.size())
     {
         FAIL(
             false,
             0,
-            "specified pair %s -> %s will be ignored because peer address can not be resolved.",
+            "specified pair %s -> %s will be ignored because it has more than %d servers.",
             listen,
-            peer
+            peer,
+            MAX_UPSTREAMS
         );
+        free(list);
         return;
     }
 
@@ -128,11 +171,11 @@ void Proxy::addProxyPair(
     if(isDebugOn())
     {
         DBG(
-            "success: adding proxy pair %s:%d ---> %s:%d",
+            "success: adding proxy pair %s:%d ---> %s (%d upstream(s))",
             ipToStr(listenAddr).c_str(),
             ntohs(listenPort),
-            ipToStr(peerAddr).c_str(),
-            ntohs(peerPort)
+            peer,
+            (int)upstreams.size()
         );
     }
 
@@ -142,8 +185,8 @@ void Proxy::addProxyPair(
         listenAddr,
         listenPort,
         peer,
-        peerAddr,
-        peerPort
+        upstreams,
+        balance
     );
 
     if(0<=pair->getSocket()) pairs.push_back(pair);
@@ -156,16 +199,15 @@ void Proxy::addProxyPair(
 
 // -----------------------------------------------------------------------
 Proxy::Pair::Pair(
-    Proxy       *_proxy,
-    const char  *_listenStr,
-    IPAddr      _listenAddr,
-    TCPPort     _listenPort,
-    const char  *_peerStr,
-    IPAddr      _peerAddr,
-    TCPPort     _peerPort
+    Proxy                       *_proxy,
+    const char                  *_listenStr,
+    IPAddr                      _listenAddr,
+    TCPPort                     _listenPort,
+    const char                  *_peerStr,
+    const std::vector<Upstream> &_upstreams,
+    int                         _balance
 )
 {
-    socket = -1;
     proxy = _proxy;
 
     listenStr = _listenStr;
@@ -173,9 +215,19 @@ Proxy::Pair::Pair(
     listenPort = _listenPort;
 
     peerStr = _peerStr;
-    peerAddr = _peerAddr;
-    peerPort = _peerPort;
+    upstreams = _upstreams;
+    balance = _balance;
+    rotation = 0;
+
+    int s = openSocket(false);
+    if(0<=s) sockets.push_back(s);
+}
 
+// -----------------------------------------------------------------------
+int Proxy::Pair::openSocket(
+    bool shared
+)
+{
     int s = proxy->makeSocket(SOCK_STREAM, 0, false);
     if(s<0)
     {
@@ -185,7 +237,7 @@ Proxy::Pair::Pair(
             "couldn't make socket to listen on %s",
             listenStr
         );
-        return;
+        return -1;
     }
 
     if(proxy->setNonBlocking(s, true, false)==false)
@@ -197,7 +249,20 @@ Proxy::Pair::Pair(
             listenStr
         );
         close(s);
-        return;
+        return -1;
+    }
+
+    int on = 1;
+    if(shared && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))<0)
+    {
+        proxy->FAIL(
+            false,
+            "setsockopt",
+            "couldn't do a setsockopt(SO_REUSEPORT) on listen socket %s",
+            listenStr
+        );
+        close(s);
+        return -1;
     }
 
     struct sockaddr_in addr;
@@ -214,7 +279,7 @@ Proxy::Pair::Pair(
             listenStr
         );
         close(s);
-        return;
+        return -1;
     }
 
     if(listen(s,100)<0)
@@ -226,15 +291,129 @@ Proxy::Pair::Pair(
             listenStr
         );
         close(s);
-        return;
+        return -1;
     }
 
-    socket = s;
+    return s;
 }
 
 // -----------------------------------------------------------------------
 Proxy::Pair::~Pair()
 {
-    close(socket);
+    int n = sockets.size();
+    for(int i=0; i<n; ++i) close(sockets[i]);
 }
 
+// -----------------------------------------------------------------------
+bool Proxy::Pair::shareSockets(
+    int count
+)
+{
+    if(count<=1) return true;
+
+    // SO_REUSEPORT has to be on every member of the group before bind, including the first
+    int n = sockets.size();
+    for(int i=0; i<n; ++i) close(sockets[i]);
+    sockets.clear();
+
+    for(int i=0; i<count; ++i)
+    {
+        int s = openSocket(true);
+        if(s<0) return false;
+        sockets.push_back(s);
+    }
+    return true;
+}
+
+
+// -----------------------------------------------------------------------
+static uint32_t mixHash(
+    uint32_t h
+)
+{
+    // Murmur3's finalizer: every input bit moves every output bit
+    h ^= h>>16;
+    h *= 0x85EBCA6B;
+    h ^= h>>13;
+    h *= 0xC2B2AE35;
+    h ^= h>>16;
+    return h;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::Pair::pickUpstream(
+    IPAddr caller
+)
+{
+    // The health checker and the resolver change servers at any time: each one is read once,
+    // and the pick is made among what that read found. Servers the health checks gave up
+    // on only get tried when there's nothing else
+    int n = upstreams.size();
+    int healthy[MAX_UPSTREAMS];
+    int resolved[MAX_UPSTREAMS];
+    int nbHealthy = 0;
+    int nbResolved = 0;
+    for(int i=0; i<n; ++i)
+    {
+        if(getPeerAddr(i)==INADDR_NONE) continue;
+        resolved[nbResolved++] = i;
+        if(isHealthy(i)) healthy[nbHealthy++] = i;
+    }
+
+    int *usable = nbHealthy ? healthy : resolved;
+    int nbUsable = nbHealthy ? nbHealthy : nbResolved;
+    if(nbUsable==0) return -1;
+
+    // Turns are taken among the servers in use, a dead one doesn't double its neighbour's share.
+    // Elsewhere the turn is where the scan starts, so that ties don't all land on the first server
+    uint32_t turn = __atomic_fetch_add(&rotation, 1, __ATOMIC_RELAXED);
+    if(balance==ROUND_ROBIN) return usable[turn%nbUsable];
+
+    int best = -1;
+    uint32_t bestScore = 0;
+    int bestCalls = 0;
+    int bestLinks = 0;
+    for(int k=0; k<nbUsable; ++k)
+    {
+        int i = usable[(turn+k)%nbUsable];
+        if(balance==SOURCE_HASH)
+        {
+            // Highest random weight: losing a server only moves the callers it had
+            uint32_t score = mixHash(caller ^ mixHash(i+1));
+            if(best<0 || bestScore<score)
+            {
+                best = i;
+                bestScore = score;
+            }
+            continue;
+        }
+
+        int calls = __atomic_load_n(&upstreams[i].nbCalls, __ATOMIC_RELAXED);
+        int links = __atomic_load_n(&upstreams[i].nbLinks, __ATOMIC_RELAXED);
+        if(best<0 || calls<bestCalls || (calls==bestCalls && links<bestLinks))
+        {
+            best = i;
+            bestCalls = calls;
+            bestLinks = links;
+        }
+    }
+    return best;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Pair::countLink(
+    int i,
+    int delta
+)
+{
+    __atomic_add_fetch(&upstreams[i].nbLinks, delta, __ATOMIC_RELAXED);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Pair::countCall(
+    int i,
+    int delta
+)
+{
+    __atomic_add_fetch(&upstreams[i].nbCalls, delta, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+
+// -----------------------------------------------------------------------
+// Multibit trie: the first 16 bits of an address index a flat root, every further
+// 4 bits a 16-slot chunk, one cache line each. A lookup is at most five array
+// reads however many prefixes went in, and a lone /32 costs four small chunks.
+// Prefixes are expanded into every slot they cover, shortest first, so that longer
+// ones simply overwrite what they are more specific than. A slot holds either a
+// verdict or, with the top bit set, where the chunk one level down starts.
+#define PREFIX_CHUNK        (((uint32_t)1)<<31)
+#define PREFIX_ROOT_BITS    16
+#define PREFIX_CHUNK_BITS   4
+
+// -----------------------------------------------------------------------
+Proxy::PrefixTable::PrefixTable()
+    :
+        nbPrefixes(0)
+{
+    // The root sits at the start of the same array as the chunks
+    slots.resize(1<<PREFIX_ROOT_BITS, NO_MATCH);
+}
+
+// -----------------------------------------------------------------------
+Proxy::PrefixTable::~PrefixTable()
+{
+}
+
+// -----------------------------------------------------------------------
+uint32_t Proxy::PrefixTable::descend(
+    uint32_t slot
+)
+{
+    // A verdict turns into a chunk that repeats it in every slot
+    if(slots[slot] & PREFIX_CHUNK) return slots[slot] & ~PREFIX_CHUNK;
+
+    uint32_t verdict = slots[slot];
+    uint32_t chunk = slots.size();
+    slots.resize(chunk + (1<<PREFIX_CHUNK_BITS), verdict);
+    slots[slot] = chunk | PREFIX_CHUNK;
+    return chunk;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::PrefixTable::build(
+    const std::vector<Prefix> &prefixes
+)
+{
+    // Counted into order by length, equal lengths keep theirs: the last one given wins
+    int n = prefixes.size();
+    int starts[34];
+    memset(starts, 0, sizeof(starts));
+    for(int i=0; i<n; ++i) ++starts[prefixes[i].length+1];
+    for(int l=1; l<34; ++l) starts[l] += starts[l-1];
+
+    std::vector<int> order(n);
+    for(int i=0; i<n; ++i) order[starts[prefixes[i].length]++] = i;
+
+    // Room for the worst case up front, the array never gets copied while it fills up
+    size_t room = slots.size();
+    for(int i=0; i<n; ++i)
+    {
+        int below = prefixes[i].length-PREFIX_ROOT_BITS;
+        if(0<below) room += ((below+PREFIX_CHUNK_BITS-1)/PREFIX_CHUNK_BITS) << PREFIX_CHUNK_BITS;
+    }
+    slots.reserve(room);
+
+    for(int i=0; i<n; ++i)
+    {
+        const Prefix &p = prefixes[order[i]];
+        uint32_t addr = p.length==0 ? 0 : p.addr & (~(uint32_t)0 << (32-p.length));
+
+        // Slots are found again by offset, the array moves while it grows
+        uint32_t base = 0;
+        int done = 0;
+        int stride = PREFIX_ROOT_BITS;
+        while(done+stride<p.length)
+        {
+            base = descend(base + ((addr<<done)>>(32-stride)));
+            done += stride;
+            stride = PREFIX_CHUNK_BITS;
+        }
+
+        uint32_t first = base + ((addr<<done)>>(32-stride));
+        uint32_t count = ((uint32_t)1)<<(done+stride-p.length);
+        for(uint32_t j=0; j<count; ++j) slots[first+j] = p.verdict;
+    }
+    nbPrefixes = n;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::PrefixTable::lookup(
+    IPAddr ip
+)
+{
+    // Addresses come in network order, like everywhere else
+    uint32_t a = ntohl(ip);
+    const uint32_t *s = &slots[0];
+    uint32_t e = s[a>>(32-PREFIX_ROOT_BITS)];
+    int done = PREFIX_ROOT_BITS;
+    while(e & PREFIX_CHUNK)
+    {
+        e = s[(e & ~PREFIX_CHUNK) + ((a<<done)>>(32-PREFIX_CHUNK_BITS))];
+        done += PREFIX_CHUNK_BITS;
+    }
+    return (int)e;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::PrefixTable::getNbChunks()
+{
+    return (slots.size()-(1<<PREFIX_ROOT_BITS))>>PREFIX_CHUNK_BITS;
+}
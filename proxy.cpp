@@ -11,6 +11,8 @@
 Proxy::Proxy(
     char **argv
 )
+    :
+        callIndex(&epoch)
 {
     wrap = true;
     info = true;
@@ -19,18 +21,44 @@ Proxy::Proxy(
     codeDebug = false;
     daemonized = false;
     packetDump = false;
+    edgeTriggered = false;
+    greRing = false;
+    uring = false;
+    trunkGSO = true;
 
     logFile = 0;
+    aclHelper = 0;
+    aclFile = 0;
+    aclFileDefault = false;
+    aclTable = 0;
+    aclReloading = 0;
+    aclCacheSize = 4096;
+    aclPositiveTTL = 300;
+    aclNegativeTTL = 30;
+    connectTimeout = 15;
     greSocket = -1;
-    calleeIdPool = 0;
-    callerIdPool = 1;
+    greBatch = 32;
+    greThreads = 1;
+    xdpCallMap = -1;
+    offloadMap = -1;
+    nbReactors = 1;
+    trunkPort = 0;
+    dnsRefresh = 300;
+    resolver = 0;
+    balance = Pair::ROUND_ROBIN;
+    healthInterval = 10;
+    healthChecker = 0;
 
     pthread_mutex_t iLock = PTHREAD_MUTEX_INITIALIZER;
-    readerLock = new pthread_mutex_t(iLock);
+    idLock = new pthread_mutex_t(iLock);
     dbLock = new pthread_mutex_t(iLock);
-    nbReaders = 0;
 
     options(argv);
+    aclCache.configure(aclCacheSize, aclPositiveTTL, aclNegativeTTL);
+    aclTable = loadACLTable(true);
+    resolver = new Resolver(this);
+    resolver->resolveAll();
+    healthChecker = new HealthChecker(this);
 
     if(setuid(0)<0)
     {
@@ -39,7 +67,17 @@ Proxy::Proxy(
     }
 
     daemonize();
-    startGREThread();
+
+    // Anything short of what the io_uring engine needs means the epoll one, not a failure
+    if(uring && Uring::probe(this)==false)
+    {
+        INFO("io_uring not usable on this kernel, falling back to epoll and recvmmsg");
+        uring = false;
+    }
+
+    resolver->start();
+    healthChecker->start();
+    startGREThreads();
     server();
 }
 
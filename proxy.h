@@ -5,12 +5,15 @@
 #ifndef __PROXY_H__
     #define __PROXY_H__
 
+    #include <map>
+    #include <deque>
     #include <vector>
     #include <string>
     #include <cstring>
     #include <stdint.h>
     #include <stdarg.h>
     #include <stddef.h>
+    #include <pthread.h>
     #include <netinet/in.h>
 
     #ifndef linux
@@ -68,6 +71,43 @@
             __VA_ARGS__         \
         )                       \
 
+    // Big enough for one unfinished PPTP message plus a full read behind it
+    #define CONTROL_BUFFER_SIZE (2*65536)
+
+    // Largest PPTP message or PPTP-IN-TCP frame we agree to reassemble
+    #define MAX_MESSAGE_SIZE    (16*1024)
+
+    // Upper bound for the number of GRE packets moved per recvmmsg/sendmmsg
+    #define MAX_GRE_BATCH       1024
+
+    // Room for one GRE packet and the IP header in front of it
+    #define GRE_BUFFER_SIZE     4096
+
+    // Per-socket output queue: reads from the other side pause above the high water mark
+    #define QUEUE_SIZE          (64*1024)
+    #define QUEUE_HIGH_WATER    (32*1024)
+    #define QUEUE_LOW_WATER     (8*1024)
+
+    // GRE packets waiting to be wrapped into a link's TCP stream, per direction (power of 2)
+    #define FRAME_RING_SIZE     (64*1024)
+
+    // Remote servers a single pair can spread its connections over
+    #define MAX_UPSTREAMS       64
+
+    // GRE threads (plain, packet ring and AF_XDP ones together) that can read the call index
+    #define EPOCH_MAX_READERS   256
+
+    // Call index records live in chunks that never move, so GRE threads can hold on to them
+    #define CALL_CHUNK_SIZE     1024
+    #define CALL_MAX_CHUNKS     1024
+
+    // UDP trunk: datagrams per recvmmsg, each big enough for what GRO coalesces into it
+    #define TRUNK_BATCH         16
+    #define TRUNK_BUFFER_SIZE   65536
+
+    // Room for the source address and segment size ancillary data of one trunk send
+    #define TRUNK_CONTROL_SIZE  64
+
     // -----------------------------------------------------------------------
     class Proxy
     {
@@ -76,92 +116,766 @@
         typedef uint32_t IPAddr;
         typedef uint32_t TCPPort;
 
+        // Key of the BPF call maps, as the programs build it on their stack
+        struct CallKey
+        {
+            uint32_t    src;
+            uint32_t    callId;
+        };
+
+        // Value of the offload map: where to send, what to rewrite, what went through
+        struct OffloadEntry
+        {
+            uint32_t    dst;
+            uint32_t    src;
+            uint32_t    callId;
+            uint32_t    pad;
+            uint64_t    packets;
+            uint64_t    bytes;
+        };
+
         // -----------------------------------------------------------------------
         class Pair
         {
+        public:
+            // How a new connection picks among several servers
+            enum { ROUND_ROBIN, LEAST_CALLS, SOURCE_HASH };
+
+            // One server behind the pair. Address and health change under running
+            // reactors, the counts are kept by the links that use it
+            struct Upstream
+            {
+                const char  *name;
+                const char  *host;
+                IPAddr      addr;
+                TCPPort     port;
+                int         healthy;
+                int         failures;
+                int         nbLinks;
+                int         nbCalls;
+            };
+
         private:
-            int         socket;
+            std::vector<int> sockets;
             Proxy       *proxy;
 
             IPAddr      listenAddr;
             TCPPort     listenPort;
             const char  *listenStr;
 
-            IPAddr      peerAddr;
-            TCPPort     peerPort;
             const char  *peerStr;
+            std::vector<Upstream> upstreams;
+            int         balance;
+            uint32_t    rotation;
 
         public:
             Pair(
-                Proxy       *_proxy,
-                const char  *_listenStr,
-                IPAddr      _listenAddr,
-                TCPPort     _listenPort,
-                const char  *_peerStr,
-                IPAddr      _peerAddr,
-                TCPPort     _peerPort
+                Proxy                       *_proxy,
+                const char                  *_listenStr,
+                IPAddr                      _listenAddr,
+                TCPPort                     _listenPort,
+                const char                  *_peerStr,
+                const std::vector<Upstream> &_upstreams,
+                int                         _balance
             );
             ~Pair();
 
-            int getSocket()             { return socket;        }
+            int openSocket(bool shared);
+            bool shareSockets(int count);
+            int pickUpstream(IPAddr caller);
+            void countLink(int i, int delta);
+            void countCall(int i, int delta);
+
+            int getSocket(int i=0)      { return i<(int)sockets.size() ? sockets[i] : -1; }
             IPAddr getListenAddr()      { return listenAddr;    }
             TCPPort getListenPort()     { return listenPort;    }
-            IPAddr getPeerAddr()        { return peerAddr;      }
-            TCPPort getPeerPort()       { return peerPort;      }
+            int getNbUpstreams()        { return upstreams.size();  }
+            Upstream &getUpstream(int i){ return upstreams[i];      }
+            IPAddr getPeerAddr(int i)   { return __atomic_load_n(&upstreams[i].addr, __ATOMIC_RELAXED);    }
+            void setPeerAddr(int i, IPAddr a) { __atomic_store_n(&upstreams[i].addr, a, __ATOMIC_RELAXED); }
+            bool isHealthy(int i)       { return __atomic_load_n(&upstreams[i].healthy, __ATOMIC_RELAXED); }
+            void setHealthy(int i, bool h) { __atomic_store_n(&upstreams[i].healthy, (int)h, __ATOMIC_RELAXED); }
             const char *getPeerName()   { return peerStr;       }
             const char *getListenName() { return listenStr;     }
         };
 
+        // -----------------------------------------------------------------------
+        class Resolver
+        {
+        private:
+            // A pair whose peer is known by name
+            struct Name
+            {
+                Pair        *pair;
+                int         upstream;
+                uint64_t    due;
+            };
+
+            Proxy       *proxy;
+            std::vector<Name> names;
+            int         next;
+
+            bool lookup(const char *host, IPAddr *addr, int *ttl);
+            void refresh(int i);
+            void run();
+            static void *startupHead(void*);
+            static void *threadHead(void*);
+
+        public:
+            Resolver(Proxy *_proxy);
+
+            void resolveAll();
+            void start();
+        };
+
+        // -----------------------------------------------------------------------
+        class HealthChecker
+        {
+        private:
+            // A server that gets probed
+            struct Target
+            {
+                Pair        *pair;
+                int         upstream;
+            };
+
+            Proxy       *proxy;
+            std::vector<Target> targets;
+
+            void probeAll();
+            void record(int i, bool ok);
+            void run();
+            static void *threadHead(void*);
+
+        public:
+            HealthChecker(Proxy *_proxy);
+
+            void start();
+        };
+
+        // -----------------------------------------------------------------------
+        class Queue
+        {
+        private:
+            uint8_t     *ring;
+            int         head;
+            int         size;
+
+        public:
+            Queue();
+            ~Queue();
+
+            bool push(const uint8_t *p, int n);
+            int flush(int socket);
+            int peek(struct iovec *iov);
+            void consume(int n);
+
+            int getSize()               { return size;          }
+            bool isEmpty()              { return size==0;       }
+        };
+
+        // -----------------------------------------------------------------------
+        class FrameRing
+        {
+        private:
+            uint8_t     *buffer;
+            uint32_t    head;
+            uint32_t    tail;
+            int         lock;
+
+        public:
+            FrameRing();
+            ~FrameRing();
+
+            bool push(const uint8_t *p, int n, bool *wasEmpty);
+            int peek(struct iovec *frames, int max);
+            void consume(int nb);
+            bool isEmpty();
+        };
+
+        // -----------------------------------------------------------------------
+        class Reactor;
+        class Uring;
+        class Link;
+
+        // -----------------------------------------------------------------------
+        class PrefixTable
+        {
+        public:
+            // Verdicts, 0 is what an address covered by no prefix gets
+            enum { NO_MATCH = 0, ALLOW = 1, DENY = 2 };
+
+            struct Prefix
+            {
+                uint32_t    addr;       // Host order
+                int         length;
+                int         verdict;
+            };
+
+        private:
+            std::vector<uint32_t> slots;
+            int         nbPrefixes;
+
+            uint32_t descend(uint32_t slot);
+
+        public:
+            PrefixTable();
+            ~PrefixTable();
+
+            void build(const std::vector<Prefix> &prefixes);
+            int lookup(IPAddr ip);
+
+            int getNbChunks();
+            int getNbPrefixes()         { return nbPrefixes;            }
+        };
+
+        // -----------------------------------------------------------------------
+        class ACLCache
+        {
+        private:
+            struct Entry
+            {
+                IPAddr      ip;
+                bool        allowed;
+                uint64_t    expires;
+                int         prev;
+                int         next;
+            };
+
+            pthread_mutex_t lock;
+            int         capacity;
+            int         positiveTTL;
+            int         negativeTTL;
+            std::vector<Entry> entries;
+            std::map<IPAddr, int> index;
+            int         head;
+            int         tail;
+
+            uint64_t    hits;
+            uint64_t    misses;
+            uint64_t    evictions;
+            uint64_t    flushes;
+
+            void unlink(int i);
+            void pushFront(int i);
+            void remove(int i);
+
+        public:
+            ACLCache();
+            ~ACLCache();
+
+            void configure(int size, int positive, int negative);
+            bool lookup(IPAddr ip, bool *allowed, uint64_t now);
+            void store(IPAddr ip, bool allowed, uint64_t now);
+            void flush();
+            void getStats(int *size, uint64_t *hits, uint64_t *misses, uint64_t *evictions, uint64_t *flushes);
+
+            bool isEnabled()            { return 0<capacity;            }
+        };
+
+        // -----------------------------------------------------------------------
+        class ACLHelper
+        {
+        private:
+            // A connection waiting for its verdict
+            struct Query
+            {
+                Link        *link;
+                uint64_t    deadline;
+            };
+
+            Proxy       *proxy;
+            Reactor     *reactor;
+            const char  *cmd;
+            int         pid;
+            int         fd;
+            int         generation;
+            uint64_t    startTime;
+            std::deque<Query> queries;
+            std::string output;
+            std::string input;
+
+            bool spawn();
+            void stop();
+            bool flush();
+
+        public:
+            ACLHelper(Proxy *_proxy, Reactor *_reactor, const char *_cmd);
+            ~ACLHelper();
+
+            void query(Link *link);
+            void readAnswers();
+            void tick();
+            int getTimeout();
+
+            bool isRunning()            { return 0<=pid;                }
+            int getFd()                 { return fd;                    }
+            int getGeneration()         { return generation;            }
+        };
+
+        // -----------------------------------------------------------------------
+        class Epoch
+        {
+        private:
+            // One cache line per reader so that GRE threads don't fight over them
+            struct Reader
+            {
+                uint64_t    epoch;
+                uint8_t     pad[64-sizeof(uint64_t)];
+            };
+
+            uint64_t    global;
+            int         nbReaders;
+            Reader      readers[EPOCH_MAX_READERS];
+
+        public:
+            Epoch();
+
+            int addReader();
+            void enter(int reader);
+            void leave(int reader);
+
+            uint64_t retire();
+            bool isQuiescent(uint64_t stamp);
+        };
+
+        // -----------------------------------------------------------------------
+        class CallIndex
+        {
+        public:
+            // Everything a GRE thread needs to forward a packet of that call, never changed once
+            // published. Packed into 32 bytes so that a lookup touches a single cache line.
+            struct Entry
+            {
+                IPAddr      src;
+                CallId      fakeId;
+                IPAddr      dst;
+                IPAddr      sndAddr;
+                CallId      realId;
+                bool        wrapToCaller;
+                uint16_t    trunkPort;
+                Link        *wrapLink;
+            } __attribute__((aligned(32)));
+
+        private:
+            // A slot holds the key's hash next to the record number, so that probing
+            // past other calls never leaves the slot array
+            struct Table
+            {
+                int         capacity;
+                uint64_t    *slots;
+            };
+
+            // Unlinked from the index, recycled once no reader can still see it
+            struct Garbage
+            {
+                uint64_t    stamp;
+                uint32_t    record;
+                Table       *table;
+            };
+
+            Epoch       *epoch;
+            Table       *table;
+            int         used;
+            int         live;
+            int         nbChunks;
+            Entry       *chunks[CALL_MAX_CHUNKS];
+            std::vector<uint32_t> freeRecords;
+            std::vector<Garbage> garbage;
+
+            static uint32_t hash(IPAddr src, CallId fakeId);
+            Entry *record(uint32_t n)   { return chunks[n/CALL_CHUNK_SIZE] + (n%CALL_CHUNK_SIZE); }
+            uint32_t allocRecord();
+            int slotOf(IPAddr src, CallId fakeId);
+            void resize(int size);
+            void place(Table *t, uint64_t slot);
+            void dispose(uint32_t record, Table *t);
+            void collect();
+
+        public:
+            CallIndex(Epoch *_epoch);
+            ~CallIndex();
+
+            const Entry *find(IPAddr src, CallId fakeId);
+            bool insert(const Entry &entry);
+            void remove(IPAddr src, CallId fakeId);
+
+            int getSize()               { return live;                  }
+        };
+
         // -----------------------------------------------------------------------
         class Link
         {
+        public:
+
+            enum State
+            {
+                ACCEPTED,
+                ACL_PENDING,
+                CONNECTING,
+                ESTABLISHED
+            };
+
+            // One call carried by the control connection, ids set by its OCRQ and OCRP
+            struct Call
+            {
+                CallId  realCallerId;
+                CallId  fakeCallerId;
+                CallId  realCalleeId;
+                CallId  fakeCalleeId;
+            };
+
         private:
 
-            Pair    *pair;
-            Proxy   *proxy;
+            // What every event and every wrapped GRE packet touches comes first,
+            // within the first two cache lines of the object
+            Reactor *reactor;
+            pthread_mutex_t ioLock;
+            int         callerSocket;
+            int         calleeSocket;
+            bool        dead;
+            bool        callerPaused;
+            bool        calleePaused;
+            State       state;
+            uint32_t    callerEvents;
+            uint32_t    calleeEvents;
+            uint32_t    drops;
+            Queue       callerQueue;
+            Queue       calleeQueue;
+            FrameRing   *callerFrames;
+            FrameRing   *calleeFrames;
+            int         wrapScheduled;
 
+            // Control path only
             IPAddr  callerIP;
-            int     callerSocket;
-            CallId  realCallerId;
-            CallId  fakeCallerId;
-	    bool    callerCanWrap;
+            bool    callerCanWrap;
+            TCPPort callerTrunkPort;
             IPAddr  callerReceivingIP;
 
             IPAddr  calleeIP;
-            int     calleeSocket;
-            CallId  realCalleeId;
-            CallId  fakeCalleeId;
             bool    calleeCanWrap;
+            TCPPort calleeTrunkPort;
+            IPAddr  calleeLocalIP;
+            std::vector<Call> calls;
+
+            // Setup, teardown and logging
+            Pair    *pair;
+            int     upstream;
+            Proxy   *proxy;
+            int     index;
+            uint64_t deadline;
+            uint32_t highWaterHits;
 
             std::string callerName;
+            std::string callerPartial;
+            std::string calleePartial;
 
         public:
 
             Link(
                 Proxy   *_proxy,
-                int     pairIndex
+                Reactor *_reactor,
+                int     pairIndex,
+                int     _callerSocket,
+                IPAddr  _callerIP
             );
             ~Link();
 
+            bool start();
+            bool connectPeer();
+            bool finishConnect();
             bool tcpPacket(bool callerPacket);
+            bool flushQueue(bool toCaller);
+            bool send(bool toCaller, const uint8_t *p, int n);
+            void sendWrapped(bool toCaller, const uint8_t *gre, int n);
+            bool flushWrapped(bool toCaller);
+            void drainWrapped(bool toCaller);
+            void unscheduleWrapped()    { __atomic_store_n(&wrapScheduled, 0, __ATOMIC_SEQ_CST); }
+            bool updateInterest();
+            bool refreshInterest();
+            uint32_t wantedEvents(bool callerSide);
+            bool controlMessage(bool callerPacket, uint8_t *msg, int size, bool *forward);
+            int processMessages(bool callerPacket, uint8_t *buf, int n);
+            int readRoom(bool callerPacket);
+            int findCall(bool callerSide, bool fake, CallId id);
+            bool remapId(bool callerPacket, bool ownId, CallId *id);
+            bool outgoingCall(bool callerPacket, uint8_t *msg, int size);
+            void publishCall(const Call &call, bool known);
+            void releaseCall(int i);
+            void releaseCalls();
+
+            bool tcpData(bool callerPacket, uint8_t *p, int n);
+            bool sent(bool toCaller, int n);
+            int peekQueue(bool toCaller, struct iovec *iov);
+            uint32_t pollEvents(bool callerSide);
+
+            int getIndex()              { return index;                 }
+            void setIndex(int i)        { index = i;                    }
+            bool isDead()               { return dead;                  }
+            void setDead()              { dead = true;                  }
+            State getState()            { return state;                 }
+            uint64_t getDeadline()      { return deadline;              }
+
+            uint32_t getHighWaterHits() { return highWaterHits;         }
+            uint32_t getDrops()         { return drops;                 }
+            void getQueued(int *toCaller, int *toCallee);
 
             Pair *getPair()             { return pair;                  }
-            const char *getPeerName()   { return pair->getPeerName();   }
+            Reactor *getReactor()       { return reactor;               }
+            const char *getPeerName()   { return upstream<0 ? pair->getPeerName() : pair->getUpstream(upstream).name; }
             const char *getListenName() { return pair->getListenName(); }
             const char *getCallerName() { return callerName.c_str();    }
 
             IPAddr getCallerIP()        { return callerIP;              }
             int getCallerSocket()       { return callerSocket;          }
-            CallId getRealCallerId()    { return realCallerId;          }
-            CallId getFakeCallerId()    { return fakeCallerId;          }
             bool getCallerCanWrap()     { return callerCanWrap;         }
+            TCPPort getCallerTrunkPort(){ return callerTrunkPort;       }
             IPAddr getCallerRCVIP()     { return callerReceivingIP;     }
 
             IPAddr getCalleeIP()        { return calleeIP;              }
             int getCalleeSocket()       { return calleeSocket;          }
-            CallId getRealCalleeId()    { return realCalleeId;          }
-            CallId getFakeCalleeId()    { return fakeCalleeId;          }
             bool getCalleeCanWrap()     { return calleeCanWrap;         }
+            TCPPort getCalleeTrunkPort(){ return calleeTrunkPort;       }
+            IPAddr getCalleeLocalIP()   { return calleeLocalIP;         }
+
+            int getNbCalls()            { return calls.size();          }
+            const Call &getCall(int i)  { return calls[i];              }
+        };
+
+        // -----------------------------------------------------------------------
+        class Reactor
+        {
+        private:
+            // What the ring is currently doing with one socket
+            struct SocketState
+            {
+                int     ops;
+                int     sending;
+                bool    recving;
+                bool    cancelling;
+                bool    polling;
+            };
+
+            // Dead link, deleted once the epoch it was retired in has drained
+            struct RetiredLink
+            {
+                Link        *link;
+                uint64_t    stamp;
+            };
+
+            Proxy               *proxy;
+            int                 id;
+            int                 epollFd;
+            uint8_t             *controlBuffer;
+
+            Uring               *uring;
+            ACLHelper           *aclHelper;
+            pthread_t           thread;
+            int                 wakeFd;
+            uint64_t            wakeCount;
+            pthread_mutex_t     mailLock;
+
+            std::vector<Link*>  fdLinks;
+            std::vector<Link*>  newLinks;
+            std::vector<Link*>  deadLinks;
+            std::vector<Link*>  connectingLinks;
+
+            std::vector<Link*>  mailbox;
+            std::vector<Link*>  touchedLinks;
+            std::vector<RetiredLink> retiredLinks;
+            std::vector<SocketState> fdStates;
+
+            // Unwrapped PPTP-IN-TCP frames waiting to go out as GRE: an IP header of
+            // our own in front of each frame, which stays where it was read
+            int                 reader;
+            int                 nbGre;
+            struct mmsghdr      *greMsgs;
+            struct iovec        *greIovs;
+            struct sockaddr_in  *greTo;
+            uint8_t             *greHeaders;
+
+        public:
+            Reactor(Proxy *_proxy, int _id);
+            ~Reactor();
+
+            void run();
+            void start();
+            static void *threadHead(void*);
+
+            bool watchLink(Link*);
+            void unwatchLink(Link*);
+            bool watchSocket(int op, int socket, uint32_t events, uint64_t tag);
+            void acceptLinks(int pairIndex);
+            void addLink(int pairIndex, int socket, IPAddr ip);
+            void killLink(Link*);
+            void expireLinks();
+            void publishLinks();
+
+            void runUring();
+            void complete(uint64_t tag, int res, uint32_t flags);
+            void touchLink(Link*);
+            void applyInterest(Link*);
+            void retireLink(Link*);
+            void reapLinks();
+            void drainMailbox();
+
+            bool queryACL(Link*);
+            void aclVerdict(Link*, bool allowed);
+            void watchHelper(int fd, int generation);
+
+            void unwrapGRE(IPAddr src, uint8_t *gre, int n);
+            void flushGRE();
+            bool isUring()              { return uring!=0;              }
+
+            int getId()                 { return id;                    }
+            int getReader()             { return reader;                }
+            uint8_t *getControlBuffer() { return controlBuffer;         }
+        };
+
+        // -----------------------------------------------------------------------
+        class XDPSocket
+        {
+        private:
+            struct Ring
+            {
+                uint32_t    *producer;
+                uint32_t    *consumer;
+                uint8_t     *descs;
+                uint32_t    mask;
+            };
+
+            Proxy   *proxy;
+            int     fd;
+            int     ifIndex;
+            int     queue;
+            uint8_t *umem;
+            Ring    fill;
+            Ring    completion;
+            Ring    rx;
+
+            bool mapRing(Ring*, const struct xdp_ring_offset*, uint64_t pgoff, int descSize);
+
+        public:
+            XDPSocket(Proxy *_proxy, int _ifIndex, int _queue);
+
+            bool open();
+            int receive(uint8_t **frames, int *lengths, int max);
+            void recycle(int n);
+
+            int getSocket()             { return fd;                    }
+        };
+
+        // -----------------------------------------------------------------------
+        class Uring
+        {
+        private:
+            Proxy       *proxy;
+            int         fd;
+
+            uint8_t     *sqMap;
+            size_t      sqMapSize;
+            uint32_t    *sqTail;
+            uint32_t    *sqArray;
+            uint32_t    sqMask;
+            uint32_t    sqEntries;
+            uint32_t    sqLocalTail;
+            uint32_t    toSubmit;
+            struct io_uring_sqe *sqes;
+
+            uint8_t     *cqMap;
+            size_t      cqMapSize;
+            uint32_t    *cqHead;
+            uint32_t    *cqTail;
+            uint32_t    cqMask;
+            struct io_uring_cqe *cqes;
+
+            struct io_uring_buf *bufRing;
+            uint8_t     *buffers;
+            int         bufferSize;
+            int         nbBuffers;
+            uint16_t    bufTail;
+
+        public:
+            Uring(Proxy *_proxy);
+            ~Uring();
+
+            bool open(int entries, int _nbBuffers, int _bufferSize);
+            struct io_uring_sqe *getSqe();
+            int enter(int waitFor, int timeout);
+            struct io_uring_cqe *peek();
+            void advance();
+            uint8_t *getBuffer(int bid);
+            void recycle(int bid);
+
+            void prepAccept(int s, uint64_t tag);
+            void prepRecv(int s, uint64_t tag);
+            void prepSend(int s, const void *p, int n, bool linked, uint64_t tag);
+            void prepSendMsg(int s, const struct msghdr *msg, uint64_t tag);
+            void prepPoll(int s, uint32_t events, uint64_t tag);
+            void prepRead(int s, void *p, int n, uint64_t tag);
+            void prepCancel(uint64_t tag);
+            void prepCancelSocket(int s);
+
+            static bool probe(Proxy*);
+        };
+
+        // -----------------------------------------------------------------------
+        class GREWorker
+        {
+        private:
+            Proxy   *proxy;
+            int     id;
+            int     reader;
+            int     rxSocket;
+            int     txSocket;
+            uint8_t *ring;
+            XDPSocket *xsk;
+            int     trunkSocket;
+            bool    fromTrunk;
+
+            int                 batch;
+            int                 nbOut;
+            struct mmsghdr      *outMsgs;
+            struct iovec        *outIovs;
+            struct sockaddr_in  *to;
+
+            // GRE going out on the trunk: payloads stay where they are, runs of
+            // same-sized ones to the same peer leave as a single segmented send
+            int                 nbTrunk;
+            struct mmsghdr      *trunkMsgs;
+            struct iovec        *trunkIovs;
+            struct sockaddr_in  *trunkTo;
+            IPAddr              *trunkFrom;
+            int                 *trunkStarts;
+            uint8_t             *trunkControl;
+
+        public:
+            GREWorker(
+                Proxy       *_proxy,
+                int         _id,
+                int         _rxSocket,
+                int         _txSocket,
+                uint8_t     *_ring,
+                XDPSocket   *_xsk,
+                int         _trunkSocket,
+                bool        _fromTrunk
+            );
+
+            void forward(uint8_t *buf, int n);
+            bool flush();
+            void trunkOut(uint8_t *buf, int n, const struct sockaddr_in *dst);
+            bool flushTrunk();
+            void flushTrunkBuffers(Uring *uring, std::vector<int> &bids);
+            void runSocket();
+            void runRing();
+            void runXDP();
+            void runUring();
+            void runTrunk();
+            void run();
+            void start();
+            static void *threadHead(void*);
+
+            int getId()                 { return id;                    }
         };
 
         // -----------------------------------------------------------------------
@@ -172,31 +886,75 @@
         bool                codeDebug;
         bool                daemonized;
         bool                packetDump;
+        bool                edgeTriggered;
+        bool                greRing;
+        bool                uring;
+        bool                trunkGSO;
 
         const char          *logFile;
+        int                 connectTimeout;
         int                 greSocket;
+        int                 greBatch;
+        int                 greThreads;
+        int                 xdpCallMap;
+        int                 offloadMap;
+        int                 nbReactors;
+        TCPPort             trunkPort;
+        int                 dnsRefresh;
+        Resolver            *resolver;
+        int                 balance;
+        int                 healthInterval;
+        HealthChecker       *healthChecker;
 
-        CallId              calleeIdPool;
-        CallId              callerIdPool;
+        // Which fake call ids a peer currently sees
+        struct IdSpace
+        {
+            uint64_t        bits[65536/64];
+            int             used;
+            int             next;
+        };
+        std::map<IPAddr, IdSpace*> idSpaces;
+        pthread_mutex_t     *idLock;
 
         pthread_mutex_t     *dbLock;
-        pthread_mutex_t     *readerLock;
-        volatile int        nbReaders;
+        Epoch               epoch;
 
         std::vector<Link*>  links;
         std::vector<Pair*>  pairs;
+        std::vector<Reactor*> reactors;
+        std::vector<GREWorker*> greWorkers;
+        std::vector<const char*> xdpInterfaces;
+        std::vector<const char*> offloadInterfaces;
+        std::vector<int>    trunkSockets;
+        CallIndex           callIndex;
 
         std::vector<IPAddr> acls;
+        std::vector<PrefixTable::Prefix> aclPrefixes;
+        PrefixTable         *aclTable;
+        const char          *aclFile;
+        bool                aclFileDefault;
+        int                 aclReloading;
         std::vector<char*>  aclCmds;
+        const char          *aclHelper;
+        ACLCache            aclCache;
+        int                 aclCacheSize;
+        int                 aclPositiveTTL;
+        int                 aclNegativeTTL;
 
         // -----------------------------------------------------------------------
         void addACL(char *acl);
-        bool checkACL(IPAddr ip);
+        bool checkACL(IPAddr ip, bool *allowed, int reader);
         void addACLCommand(char *acl);
+        void setACLFile(const char *path);
+        PrefixTable *loadACLTable(bool fatal);
+        void reloadACLTable();
+        static void *reloadThread(void*);
+        void setACLHelper(const char *cmd);
+        void setACLCacheSize(const char*);
+        void setACLCacheTTL(const char*);
 
-        bool remapId(CallId*,CallId);
         void addProxyPair(char *acl);
-        bool findPeer(IPAddr*, CallId*, IPAddr, CallId, int*, IPAddr*);
+        bool findPeer(IPAddr*, CallId*, IPAddr, CallId, Link**, bool*, IPAddr*, TCPPort*);
 
         void vlog(
             const char  *fileName,
@@ -242,31 +1000,73 @@
             ...
         );
 
-        bool isInfoOn()         { return info;          }
-        bool isDebugOn()        { return debug;         }
-        bool isPacketDumpOn()   { return packetDump;    }
-        bool isWrapAllowed()    { return wrap;          }
+        bool isInfoOn()             { return info;              }
+        bool isDebugOn()            { return debug;             }
+        bool isPacketDumpOn()       { return packetDump;        }
+        bool isWrapAllowed()        { return wrap;              }
+        bool isEdgeTriggered()      { return edgeTriggered;     }
+        bool isUring()              { return uring;             }
+        int getConnectTimeout()     { return connectTimeout;    }
+        int getNbReactors()         { return nbReactors;        }
+        TCPPort getTrunkPort()      { return trunkPort;         }
+        int getDNSRefresh()         { return dnsRefresh;        }
+        int getHealthInterval()     { return healthInterval;    }
+        const char *getACLHelper()  { return aclHelper;         }
 
-        CallId allocCalleeId();
-        CallId allocCallerId();
+        CallId allocCallId(IPAddr peer);
+        void freeCallId(IPAddr peer, CallId id);
 
-        void greThread();
-        void startGREThread();
-        static void *threadHead(void*);
+        bool forwardGRE(uint8_t *buf, int n, IPAddr src, struct sockaddr_in *to);
+        int makeGRESocket(bool receive);
+        int makeGREListener(int fanoutId, uint8_t **ring);
+        void startGREThreads();
+
+        int makeTrunkSocket(bool receive);
+        void startTrunk();
+
+        void startXDP();
+        int xdpProgram(int xskMap);
+
+        void startOffload();
+        int offloadProgram();
+        void publishCall(const CallIndex::Entry &call, IPAddr out, bool known, bool offload);
+        void publishOffload(IPAddr src, CallId fakeId, IPAddr dst, IPAddr out, CallId realId, bool known, bool offload);
+        void offloadCounters(IPAddr src, CallId fakeId, uint64_t *packets, uint64_t *bytes);
+
+        static struct bpf_insn bpfInsn(uint8_t code, int dst, int src, int16_t off, int32_t imm);
+        static void bpfLoadMap(std::vector<struct bpf_insn> &prog, int reg, int map);
+
+        int bpfMapCreate(int type, int keySize, int valueSize, int maxEntries, const char *name);
+        bool bpfMapUpdate(int map, const void *key, const void *value);
+        bool bpfMapDelete(int map, const void *key);
+        bool bpfMapLookup(int map, const void *key, void *value);
+        int bpfProgLoad(int type, const struct bpf_insn *insns, int nbInsns, const char *name);
+        int bpfLinkCreate(int prog, int ifIndex, int attachType, uint32_t flags);
 
         void server();
+        void dumpStats();
+        void checkSignals();
+        uint64_t now();
         void daemonize();
         void options(char **argv);
+        void setConnectTimeout(const char*);
+        void setReactors(const char*);
+        void setGREBatch(const char*);
+        void setGREThreads(const char*);
+        void addXDPInterface(const char*);
+        void addOffloadInterface(const char*);
+        void setTrunkPort(const char*);
+        void setDNSRefresh(const char*);
+        void setBalance(const char*);
+        void setHealthInterval(const char*);
         std::string ipToStr(IPAddr);
         void dumpPacket(uint8_t *buf, ssize_t length);
         int makeSocket(int type,int proto,bool fatal);
         bool setNonBlocking(int s,bool yes,bool fatal);
-        bool parseAddress(IPAddr*,TCPPort*,const char*);
+        bool startThread(void *(*head)(void*),void *arg,bool fatal,const char *what);
+        bool parseAddress(IPAddr*,TCPPort*,const char*,char **host=0);
         bool resolve(IPAddr*,const char *add,bool fatal);
 
-        void enterDBReadOnly();
-        void leaveDBReadOnly();
-
         void enterDBReadWrite();
         void leaveDBReadWrite();
 
@@ -0,0 +1,114 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// -----------------------------------------------------------------------
+Proxy::Queue::Queue()
+    :
+        ring(0),
+        head(0),
+        size(0)
+{
+}
+
+// -----------------------------------------------------------------------
+Proxy::Queue::~Queue()
+{
+    delete [] ring;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Queue::push(
+    const uint8_t   *p,
+    int             n
+)
+{
+    if(QUEUE_SIZE<size+n) return false;
+
+    // Idle links don't carry a ring around, busy ones only get one when the socket is full
+    if(ring==0) ring = new uint8_t[QUEUE_SIZE];
+
+    int tail = (head+size) % QUEUE_SIZE;
+    int chunk = QUEUE_SIZE-tail;
+    if(n<chunk) chunk = n;
+    memcpy(ring+tail, p, chunk);
+    memcpy(ring, p+chunk, n-chunk);
+    size += n;
+    return true;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::Queue::flush(
+    int socket
+)
+{
+    int total = 0;
+    while(0<size)
+    {
+        struct iovec iov[2];
+        int chunk = QUEUE_SIZE-head;
+        if(size<chunk) chunk = size;
+        iov[0].iov_base = ring+head;
+        iov[0].iov_len = chunk;
+        iov[1].iov_base = ring;
+        iov[1].iov_len = size-chunk;
+
+        ssize_t s = writev(socket, iov, size==chunk ? 1 : 2);
+        if(s<0)
+        {
+            if(errno==EINTR)    continue;
+            if(errno==EAGAIN)   break;
+            return -1;
+        }
+
+        head = (head+s) % QUEUE_SIZE;
+        size -= s;
+        total += s;
+    }
+
+    if(size==0)
+    {
+        delete [] ring;
+        ring = 0;
+        head = 0;
+    }
+    return total;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::Queue::peek(
+    struct iovec *iov
+)
+{
+    // At most two pieces: up to the end of the ring, then from its start
+    if(size==0) return 0;
+    int chunk = QUEUE_SIZE-head;
+    if(size<chunk) chunk = size;
+    iov[0].iov_base = ring+head;
+    iov[0].iov_len = chunk;
+    iov[1].iov_base = ring;
+    iov[1].iov_len = size-chunk;
+    return size==chunk ? 1 : 2;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Queue::consume(
+    int n
+)
+{
+    if(size<n) n = size;
+    head = (head+n) % QUEUE_SIZE;
+    size -= n;
+    if(size==0)
+    {
+        delete [] ring;
+        ring = 0;
+        head = 0;
+    }
+}
@@ -0,0 +1,990 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#if defined(linux)
+    #include <poll.h>
+    #include <sys/eventfd.h>
+    #include <linux/io_uring.h>
+#endif
+
+// -----------------------------------------------------------------------
+#define MAX_EVENTS  256
+#define LISTEN_TAG  (((uint64_t)1)<<32)
+#define WAKE_TAG    (((uint64_t)1)<<33)
+#define ACL_TAG     (((uint64_t)1)<<34)
+
+// Unwrapped GRE frames sent per sendmmsg, at most
+#define UNWRAP_BATCH        64
+
+// Dead links wait for GRE threads to leave their epoch, which takes microseconds: poll for that in ms
+#define REAP_INTERVAL       1
+
+// io_uring requests carry their kind in the low byte of the tag, a socket or pair index above it
+#define URING_ENTRIES       1024
+#define URING_BUFFERS       256
+#define URING_BUFFER_SIZE   (16*1024)
+#define URING_ACCEPT        1
+#define URING_WAKE          2
+#define URING_RECV          3
+#define URING_SEND          4
+#define URING_CONNECT       5
+#define URING_ACL           6
+#define URING_TAG(kind, n)  ((((uint64_t)(n))<<8) | (kind))
+
+// -----------------------------------------------------------------------
+Proxy::Reactor::Reactor(
+    Proxy   *_proxy,
+    int     _id
+)
+    :
+        proxy(_proxy),
+        id(_id),
+        epollFd(-1),
+        controlBuffer(0),
+        uring(0),
+        aclHelper(0),
+        wakeFd(-1),
+        wakeCount(0),
+        nbGre(0)
+{
+    pthread_mutex_t iLock = PTHREAD_MUTEX_INITIALIZER;
+    mailLock = iLock;
+    controlBuffer = new uint8_t[CONTROL_BUFFER_SIZE];
+
+    // Unwrapping looks calls up like a GRE thread does
+    reader = proxy->epoch.addReader();
+    if(reader<0) proxy->FAIL(true, 0, "too many GRE threads and reactors, at most %d", EPOCH_MAX_READERS);
+
+    greMsgs = new struct mmsghdr[UNWRAP_BATCH];
+    greIovs = new struct iovec[2*UNWRAP_BATCH];
+    greTo = new struct sockaddr_in[UNWRAP_BATCH];
+    greHeaders = new uint8_t[UNWRAP_BATCH*20];
+    memset(greMsgs, 0, UNWRAP_BATCH*sizeof(greMsgs[0]));
+    for(int i=0; i<UNWRAP_BATCH; ++i)
+    {
+        greIovs[2*i].iov_base = greHeaders + 20*i;
+        greIovs[2*i].iov_len = 20;
+        greMsgs[i].msg_hdr.msg_iov = greIovs + 2*i;
+        greMsgs[i].msg_hdr.msg_iovlen = 2;
+        greMsgs[i].msg_hdr.msg_name = greTo + i;
+        greMsgs[i].msg_hdr.msg_namelen = sizeof(greTo[i]);
+    }
+
+    #if defined(linux)
+        // Listen sockets get their multishot accepts once the reactor runs
+        if(proxy->isUring())
+        {
+            uring = new Uring(proxy);
+            if(uring->open(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE)==false)
+            {
+                proxy->FAIL(true, 0, "couldn't set up io_uring for reactor %d", id);
+            }
+            wakeFd = eventfd(0, EFD_CLOEXEC);
+            if(wakeFd<0) proxy->FAIL(true, "eventfd", "couldn't create wakeup descriptor for reactor %d", id);
+            return;
+        }
+    #endif
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd<0) proxy->FAIL(true, "epoll_create1", "couldn't create epoll descriptor for reactor %d", id);
+
+    // Each reactor owns one listen socket per pair, the kernel spreads connections among them
+    int n = proxy->pairs.size();
+    for(int i=0; i<n; ++i)
+    {
+        Pair *pair = proxy->pairs[i];
+        bool ok = watchSocket(
+            EPOLL_CTL_ADD,
+            pair->getSocket(id),
+            EPOLLIN | EPOLLPRI,
+            LISTEN_TAG | (uint64_t)i
+        );
+        if(ok==false) proxy->FAIL(true, 0, "couldn't watch listen socket %s", pair->getListenName());
+    }
+
+    // GRE threads hand over wrapped packets through the mailbox
+    #if defined(linux)
+        wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if(wakeFd<0) proxy->FAIL(true, "eventfd", "couldn't create wakeup descriptor for reactor %d", id);
+        if(watchSocket(EPOLL_CTL_ADD, wakeFd, EPOLLIN, WAKE_TAG)==false)
+        {
+            proxy->FAIL(true, 0, "couldn't watch wakeup descriptor for reactor %d", id);
+        }
+    #endif
+}
+
+// -----------------------------------------------------------------------
+Proxy::Reactor::~Reactor()
+{
+    if(0<=epollFd) close(epollFd);
+    if(0<=wakeFd) close(wakeFd);
+    pthread_mutex_destroy(&mailLock);
+    delete [] controlBuffer;
+    delete [] greMsgs;
+    delete [] greIovs;
+    delete [] greTo;
+    delete [] greHeaders;
+    delete aclHelper;
+    delete uring;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Reactor::watchSocket(
+    int         op,
+    int         socket,
+    uint32_t    events,
+    uint64_t    tag
+)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    if(proxy->isEdgeTriggered()) event.events |= EPOLLET;
+    event.data.u64 = tag;
+
+    int r = epoll_ctl(epollFd, op, socket, &event);
+    if(r<0)
+    {
+        proxy->FAIL(
+            false,
+            "epoll_ctl",
+            "couldn't %s socket %d in epoll set",
+            op==EPOLL_CTL_ADD ? "add" : "modify",
+            socket
+        );
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Reactor::watchLink(
+    Link *link
+)
+{
+    int s1 = link->getCallerSocket();
+    int s2 = link->getCalleeSocket();
+    int max = s1<s2 ? s2 : s1;
+    if((int)fdLinks.size()<=max) fdLinks.resize(max+1, 0);
+    fdLinks[s1] = link;
+    fdLinks[s2] = link;
+
+    if(uring)
+    {
+        SocketState idle;
+        memset(&idle, 0, sizeof(idle));
+        if((int)fdStates.size()<=max) fdStates.resize(max+1, idle);
+        fdStates[s1] = idle;
+        fdStates[s2] = idle;
+    }
+    return link->refreshInterest();
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::unwatchLink(
+    Link *link
+)
+{
+    int s1 = link->getCallerSocket();
+    int s2 = link->getCalleeSocket();
+    if(fdLinks[s1]==link)
+    {
+        fdLinks[s1] = 0;
+        if(uring==0) epoll_ctl(epollFd, EPOLL_CTL_DEL, s1, 0);
+    }
+    if(fdLinks[s2]==link)
+    {
+        fdLinks[s2] = 0;
+        if(uring==0) epoll_ctl(epollFd, EPOLL_CTL_DEL, s2, 0);
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::killLink(
+    Link *link
+)
+{
+    link->setDead();
+    deadLinks.push_back(link);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::acceptLinks(
+    int pairIndex
+)
+{
+    Pair *pair = proxy->pairs[pairIndex];
+    while(1)
+    {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        int s = accept(pair->getSocket(id), (struct sockaddr*)&addr, &addrLen);
+        if(s<0)
+        {
+            if(errno==EINTR)            continue;
+            if(errno==EAGAIN)           break;
+            if(errno==ECONNABORTED)     continue;
+            proxy->FAIL(
+                false,
+                "accept",
+                "accept failed on listen socket for pair %s -> %s",
+                pair->getListenName(),
+                pair->getPeerName()
+            );
+            break;
+        }
+
+        addLink(pairIndex, s, (IPAddr)addr.sin_addr.s_addr);
+
+        // In level-triggered mode, epoll will tell us again if more are pending
+        if(proxy->isEdgeTriggered()==false) break;
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::addLink(
+    int     pairIndex,
+    int     s,
+    IPAddr  ip
+)
+{
+    Pair *pair = proxy->pairs[pairIndex];
+    DBGP(
+        "reactor %d: new link request on interface %s, proxying to %s",
+        id,
+        pair->getListenName(),
+        pair->getPeerName()
+    );
+
+    Link *newLink = new Link(proxy, this, pairIndex, s, ip);
+    bool newLinkOK = newLink->start();
+
+    DBGP(
+        "new link request on interface %s %s.",
+        pair->getListenName(),
+        newLinkOK ? "suceeded" : "failed"
+    );
+
+    // Links waiting on the ACL helper are its own until it answers
+    if(newLinkOK==false)                                delete newLink;
+    else if(newLink->getState()!=Link::ACL_PENDING)     newLinks.push_back(newLink);
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Reactor::queryACL(
+    Link *link
+)
+{
+    if(aclHelper==0) return false;
+    aclHelper->query(link);
+    return true;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::aclVerdict(
+    Link    *link,
+    bool    allowed
+)
+{
+    if(allowed==false)
+    {
+        proxy->FAIL(
+            false,
+            0,
+            "unauthorized connection from IP %s",
+            link->getCallerName()
+        );
+        delete link;
+        return;
+    }
+
+    // From here on the link is like any other just accepted
+    if(link->connectPeer()) newLinks.push_back(link);
+    else                    delete link;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::watchHelper(
+    int fd,
+    int generation
+)
+{
+    // One poll at a time in uring mode, tagged so that one left over from a dead helper is ignored
+    #if defined(linux)
+        if(uring)
+        {
+            uring->prepPoll(fd, POLLIN, URING_TAG(URING_ACL, generation));
+            return;
+        }
+    #endif
+    if(watchSocket(EPOLL_CTL_ADD, fd, EPOLLIN, ACL_TAG)==false)
+    {
+        proxy->FAIL(false, 0, "reactor %d: couldn't watch ACL helper", id);
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::expireLinks()
+{
+    uint64_t t = proxy->now();
+    int n = connectingLinks.size();
+    for(int i=0; i<n; ++i)
+    {
+        Link *link = connectingLinks[i];
+        bool done = link->isDead() || link->getState()!=Link::CONNECTING;
+        if(done==false && link->getDeadline()<=t)
+        {
+            proxy->FAIL(
+                false,
+                0,
+                "connection to server %s timed out after %d seconds",
+                link->getPeerName(),
+                proxy->getConnectTimeout()
+            );
+            killLink(link);
+            done = true;
+        }
+        if(done)
+        {
+            connectingLinks[i--] = connectingLinks[--n];
+            connectingLinks.pop_back();
+        }
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::publishLinks()
+{
+    int nbNew = newLinks.size();
+    for(int i=0; i<nbNew; ++i)
+    {
+        Link *link = newLinks[i];
+        if(watchLink(link))
+        {
+            if(link->getState()==Link::CONNECTING) connectingLinks.push_back(link);
+            continue;
+        }
+        unwatchLink(link);
+        delete link;
+        newLinks[i] = 0;
+    }
+
+    int n1 = newLinks.size();
+    int n2 = deadLinks.size();
+    for(int i=0; i<n2; ++i) unwatchLink(deadLinks[i]);
+    if(n1==0 && n2==0) return;
+
+    // The link table is shared with the GRE thread and the other reactors
+    std::vector<Link*> &links = proxy->links;
+    proxy->enterDBReadWrite();
+        while(n1--)
+        {
+            Link *link = newLinks[n1];
+            if(link==0) continue;
+            link->setIndex(links.size());
+            links.push_back(link);
+        }
+        while(n2--)
+        {
+            Link *link = deadLinks[n2];
+            int i = link->getIndex();
+            DBGP(
+                "reactor %d: removing links[%d] = %s -> %s",
+                id,
+                i,
+                link->getCallerName(),
+                link->getPeerName()
+            );
+
+            links[i] = links[links.size()-1];
+            links[i]->setIndex(i);
+            links.pop_back();
+            link->releaseCalls();
+            retireLink(link);
+        }
+    proxy->leaveDBReadWrite();
+    deadLinks.clear();
+    newLinks.clear();
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::run()
+{
+    // The helper is started by the first tick, from the thread that talks to it
+    if(proxy->getACLHelper()) aclHelper = new ACLHelper(proxy, this, proxy->getACLHelper());
+
+    #if defined(linux)
+        if(uring)
+        {
+            runUring();
+            return;
+        }
+    #endif
+
+    DBGP(
+        "reactor %d: up and running -- waiting for inbound TCP connections (%s-triggered epoll)",
+        id,
+        proxy->isEdgeTriggered() ? "edge" : "level"
+    );
+
+    thread = pthread_self();
+    struct epoll_event events[MAX_EVENTS];
+    while(1)
+    {
+        int timeout = -1;
+        uint64_t t = proxy->now();
+        int n = connectingLinks.size();
+        for(int i=0; i<n; ++i)
+        {
+            uint64_t deadline = connectingLinks[i]->getDeadline();
+            int delta = deadline<=t ? 0 : (int)(deadline-t);
+            if(timeout<0 || delta<timeout) timeout = delta;
+        }
+        if(retiredLinks.empty()==false && (timeout<0 || REAP_INTERVAL<timeout)) timeout = REAP_INTERVAL;
+        if(aclHelper)
+        {
+            aclHelper->tick();
+            int delta = aclHelper->getTimeout();
+            if(0<=delta && (timeout<0 || delta<timeout)) timeout = delta;
+        }
+
+        int ret = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+        if(ret<0)
+        {
+            if(errno!=EINTR && errno!=EAGAIN)
+            {
+                proxy->FAIL(
+                    false,
+                    "epoll_wait",
+                    "epoll_wait failed !\n"
+                );
+            }
+            ret = 0;
+        }
+
+        proxy->checkSignals();
+
+        for(int i=0; i<ret; ++i)
+        {
+            uint64_t tag = events[i].data.u64;
+            uint32_t flags = events[i].events;
+            if(tag==WAKE_TAG)
+            {
+                if(read(wakeFd, &wakeCount, sizeof(wakeCount))<0 && errno!=EAGAIN)
+                {
+                    proxy->FAIL(false, "read", "couldn't read wakeup descriptor for reactor %d", id);
+                }
+                continue;
+            }
+            if(tag==ACL_TAG)
+            {
+                aclHelper->readAnswers();
+                continue;
+            }
+            if(tag & LISTEN_TAG)
+            {
+                int pairIndex = (int)(tag & ~LISTEN_TAG);
+                if(flags & (EPOLLERR|EPOLLPRI))
+                {
+                    proxy->FAIL(
+                        false,
+                        "epoll",
+                        "exception on listen socket %s -> %s!\n",
+                        proxy->pairs[pairIndex]->getListenName(),
+                        proxy->pairs[pairIndex]->getPeerName()
+                    );
+                }
+                if(flags & EPOLLIN) acceptLinks(pairIndex);
+                continue;
+            }
+
+            int s = (int)tag;
+            Link *link = (s<(int)fdLinks.size()) ? fdLinks[s] : 0;
+            if(link==0 || link->isDead()) continue;
+
+            bool linkOK = true;
+            bool callerPacket = (s==link->getCallerSocket());
+            if(link->getState()==Link::CONNECTING)
+            {
+                if(callerPacket)
+                {
+                    DBGP("caller %s went away while connecting to peer", link->getCallerName());
+                    linkOK = false;
+                }
+                else if(link->finishConnect())
+                {
+                    linkOK = link->refreshInterest();
+                }
+                else
+                {
+                    linkOK = false;
+                }
+            }
+            else if(flags & (EPOLLERR|EPOLLPRI)) linkOK = false;
+            else
+            {
+                if(flags & EPOLLOUT)                    linkOK = linkOK && link->flushQueue(callerPacket);
+                if(flags & (EPOLLIN|EPOLLHUP))          linkOK = linkOK && link->tcpPacket(callerPacket);
+                if(flags & EPOLLHUP)                    linkOK = false;
+            }
+
+            if(linkOK==false)
+            {
+                DBGP(
+                    "exception on tcp link %s -> %s.",
+                    link->getCallerName(),
+                    link->getPeerName()
+                );
+                killLink(link);
+            }
+        }
+
+        drainMailbox();
+        expireLinks();
+        publishLinks();
+        reapLinks();
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::touchLink(
+    Link *link
+)
+{
+    // From any thread: the link's own reactor, or GRE threads with wrapped packets for it
+    if(pthread_equal(pthread_self(), thread))
+    {
+        touchedLinks.push_back(link);
+        return;
+    }
+
+    pthread_mutex_lock(&mailLock);
+        bool wake = mailbox.empty();
+        if(wake || mailbox.back()!=link) mailbox.push_back(link);
+    pthread_mutex_unlock(&mailLock);
+
+    uint64_t one = 1;
+    if(wake && write(wakeFd, &one, sizeof(one))<0)
+    {
+        proxy->FAIL(false, "write", "couldn't wake up reactor %d", id);
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::retireLink(
+    Link *link
+)
+{
+    // Whatever the ring still does with the link's sockets must finish before it goes away
+    #if defined(linux)
+        int s[2] = { link->getCallerSocket(), link->getCalleeSocket() };
+        for(int i=0; uring && i<2; ++i)
+        {
+            bool busy = 0<=s[i] && s[i]<(int)fdStates.size() && 0<fdStates[s[i]].ops;
+            if(busy) uring->prepCancelSocket(s[i]);
+        }
+    #endif
+
+    // So must any GRE thread that found the link in the call index before it got unpublished
+    RetiredLink retired;
+    retired.link = link;
+    retired.stamp = proxy->epoch.retire();
+    retiredLinks.push_back(retired);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::reapLinks()
+{
+    std::vector<Link*> reaped;
+    int n = retiredLinks.size();
+    for(int i=0; i<n; ++i)
+    {
+        Link *link = retiredLinks[i].link;
+        int s[2] = { link->getCallerSocket(), link->getCalleeSocket() };
+        int ops = 0;
+        for(int j=0; j<2; ++j)
+        {
+            if(0<=s[j] && s[j]<(int)fdStates.size()) ops += fdStates[s[j]].ops;
+        }
+        if(0<ops || proxy->epoch.isQuiescent(retiredLinks[i].stamp)==false) continue;
+
+        reaped.push_back(link);
+        retiredLinks[i--] = retiredLinks[--n];
+        retiredLinks.pop_back();
+    }
+    if(reaped.empty()) return;
+
+    // GRE threads may have posted these to the mailbox on their way out of the epoch
+    drainMailbox();
+
+    n = reaped.size();
+    for(int i=0; i<n; ++i) delete reaped[i];
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::drainMailbox()
+{
+    pthread_mutex_lock(&mailLock);
+        touchedLinks.insert(touchedLinks.end(), mailbox.begin(), mailbox.end());
+        mailbox.clear();
+    pthread_mutex_unlock(&mailLock);
+
+    while(touchedLinks.empty()==false)
+    {
+        std::vector<Link*> touched;
+        touched.swap(touchedLinks);
+        int nbTouched = touched.size();
+        for(int i=0; i<nbTouched; ++i)
+        {
+            // Before looking at the rings, so that anything pushed from now on asks again
+            Link *link = touched[i];
+            link->unscheduleWrapped();
+            if(uring)
+            {
+                applyInterest(link);
+                continue;
+            }
+            if(link->isDead()) continue;
+            if(link->flushQueue(true)==false || link->flushQueue(false)==false) killLink(link);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------
+#if defined(linux)
+
+    void Proxy::Reactor::applyInterest(
+        Link *link
+    )
+    {
+        if(link->isDead()) return;
+        for(int side=0; side<2; ++side)
+        {
+            bool callerSide = (side==0);
+            int s = callerSide ? link->getCallerSocket() : link->getCalleeSocket();
+            SocketState *state = &fdStates[s];
+
+            // Only the outcome of the connect matters until it's done
+            if(link->getState()==Link::CONNECTING)
+            {
+                if(callerSide==false && state->polling==false)
+                {
+                    uring->prepPoll(s, POLLOUT, URING_TAG(URING_CONNECT, s));
+                    state->polling = true;
+                    ++state->ops;
+                }
+                continue;
+            }
+
+            link->drainWrapped(callerSide);
+            uint32_t events = link->pollEvents(callerSide);
+            if(events & EPOLLIN)
+            {
+                // Bytes held back while the other side was full go before anything new
+                if(link->tcpData(callerSide, 0, 0)==false)
+                {
+                    killLink(link);
+                    return;
+                }
+                if(state->recving==false)
+                {
+                    uring->prepRecv(s, URING_TAG(URING_RECV, s));
+                    state->recving = true;
+                    ++state->ops;
+                }
+            }
+            else if(state->recving && state->cancelling==false)
+            {
+                uring->prepCancel(URING_TAG(URING_RECV, s));
+                state->cancelling = true;
+            }
+
+            // Both halves of a wrapped queue go out as a chain, in order
+            if((events & EPOLLOUT) && state->sending==0)
+            {
+                struct iovec iov[2];
+                int n = link->peekQueue(callerSide, iov);
+                for(int i=0; i<n; ++i)
+                {
+                    uring->prepSend(s, iov[i].iov_base, iov[i].iov_len, i+1<n, URING_TAG(URING_SEND, s));
+                }
+                state->sending = n;
+                state->ops += n;
+            }
+        }
+    }
+
+    // -----------------------------------------------------------------------
+    void Proxy::Reactor::complete(
+        uint64_t    tag,
+        int         res,
+        uint32_t    flags
+    )
+    {
+        int kind = (int)(tag & 0xFF);
+        int n = (int)(tag>>8);
+        bool more = (flags & IORING_CQE_F_MORE)!=0;
+        if(kind==0) return;
+
+        if(kind==URING_ACCEPT)
+        {
+            Pair *pair = proxy->pairs[n];
+            if(0<=res)
+            {
+                struct sockaddr_in addr;
+                socklen_t addrLen = sizeof(addr);
+                memset(&addr, 0, sizeof(addr));
+                getpeername(res, (struct sockaddr*)&addr, &addrLen);
+                addLink(n, res, (IPAddr)addr.sin_addr.s_addr);
+            }
+            else if(res!=-ECONNABORTED && res!=-EINTR)
+            {
+                errno = -res;
+                proxy->FAIL(
+                    false,
+                    "accept",
+                    "accept failed on listen socket for pair %s -> %s",
+                    pair->getListenName(),
+                    pair->getPeerName()
+                );
+            }
+            if(more==false) uring->prepAccept(pair->getSocket(id), tag);
+            return;
+        }
+
+        if(kind==URING_WAKE)
+        {
+            uring->prepRead(wakeFd, &wakeCount, sizeof(wakeCount), tag);
+            return;
+        }
+
+        if(kind==URING_ACL)
+        {
+            // Reading may find the helper dead, its successor then has a poll of its own
+            if(n!=aclHelper->getGeneration()) return;
+            aclHelper->readAnswers();
+            if(n==aclHelper->getGeneration() && aclHelper->isRunning()) uring->prepPoll(aclHelper->getFd(), POLLIN, tag);
+            return;
+        }
+
+        // Socket requests: bookkeeping first, the link may well be gone already
+        SocketState *state = &fdStates[n];
+        Link *link = fdLinks[n];
+        bool live = (link!=0 && link->isDead()==false);
+        bool callerSide = live && n==link->getCallerSocket();
+        bool ok = true;
+
+        if(kind==URING_RECV)
+        {
+            if(more==false)
+            {
+                --state->ops;
+                state->recving = false;
+                state->cancelling = false;
+            }
+            if(flags & IORING_CQE_F_BUFFER)
+            {
+                int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                if(live && 0<res) ok = link->tcpData(callerSide, uring->getBuffer(bid), res);
+                uring->recycle(bid);
+            }
+            if(live && ok && res==0)
+            {
+                DBGP(
+                    "EOF condition on control socket for link %s -> %s",
+                    link->getCallerName(),
+                    link->getPeerName()
+                );
+                ok = false;
+            }
+            else if(live && ok && res<0 && res!=-ENOBUFS && res!=-ECANCELED)
+            {
+                errno = -res;
+                proxy->FAIL(
+                    false,
+                    "recv",
+                    "tcp read failed on control socket for link %s -> %s",
+                    link->getCallerName(),
+                    link->getPeerName()
+                );
+                ok = false;
+            }
+            if(live && ok && more==false) touchLink(link);
+        }
+        else if(kind==URING_SEND)
+        {
+            --state->ops;
+            --state->sending;
+            if(live && 0<=res) ok = link->sent(callerSide, res);
+            else if(live)
+            {
+                errno = -res;
+                proxy->FAIL(
+                    false,
+                    "send",
+                    "tcp write failed on control socket for link %s -> %s",
+                    link->getCallerName(),
+                    link->getPeerName()
+                );
+                ok = false;
+            }
+        }
+        else if(kind==URING_CONNECT)
+        {
+            --state->ops;
+            state->polling = false;
+            if(live) ok = link->finishConnect() && link->refreshInterest();
+        }
+
+        if(live && ok==false)
+        {
+            DBGP(
+                "exception on tcp link %s -> %s.",
+                link->getCallerName(),
+                link->getPeerName()
+            );
+            killLink(link);
+        }
+    }
+
+    // -----------------------------------------------------------------------
+    void Proxy::Reactor::runUring()
+    {
+        DBGP("reactor %d: up and running -- waiting for inbound TCP connections (io_uring)", id);
+
+        thread = pthread_self();
+        int n = proxy->pairs.size();
+        for(int i=0; i<n; ++i) uring->prepAccept(proxy->pairs[i]->getSocket(id), URING_TAG(URING_ACCEPT, i));
+        uring->prepRead(wakeFd, &wakeCount, sizeof(wakeCount), URING_TAG(URING_WAKE, 0));
+
+        while(1)
+        {
+            int timeout = -1;
+            uint64_t t = proxy->now();
+            n = connectingLinks.size();
+            for(int i=0; i<n; ++i)
+            {
+                uint64_t deadline = connectingLinks[i]->getDeadline();
+                int delta = deadline<=t ? 0 : (int)(deadline-t);
+                if(timeout<0 || delta<timeout) timeout = delta;
+            }
+            if(retiredLinks.empty()==false && (timeout<0 || REAP_INTERVAL<timeout)) timeout = REAP_INTERVAL;
+            if(aclHelper)
+            {
+                aclHelper->tick();
+                int delta = aclHelper->getTimeout();
+                if(0<=delta && (timeout<0 || delta<timeout)) timeout = delta;
+            }
+
+            // One system call per tick: everything queued last time goes in, completions come out
+            uring->enter(1, timeout);
+            proxy->checkSignals();
+
+            struct io_uring_cqe *cqe;
+            while((cqe = uring->peek())!=0)
+            {
+                uint64_t tag = cqe->user_data;
+                int res = cqe->res;
+                uint32_t flags = cqe->flags;
+                uring->advance();
+                complete(tag, res, flags);
+            }
+
+            expireLinks();
+            do
+            {
+                publishLinks();
+                drainMailbox();
+            } while(deadLinks.empty()==false);
+            reapLinks();
+        }
+    }
+
+#endif
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::unwrapGRE(
+    IPAddr  src,
+    uint8_t *gre,
+    int     n
+)
+{
+    // A PPTP-IN-TCP frame is a bare GRE packet, call id already set for the hop that wrapped it
+    if(n<8) return;
+    CallId callId = gre[6] | (((uint32_t)gre[7])<<8);
+
+    IPAddr dst;
+    IPAddr out;
+    CallId realCallId;
+    Link *wrapLink;
+    bool wrapToCaller;
+    TCPPort trunkPort;
+    proxy->epoch.enter(reader);
+        bool found = proxy->findPeer(&dst, &realCallId, src, callId, &wrapLink, &wrapToCaller, &out, &trunkPort);
+    proxy->epoch.leave(reader);
+    if(found==false) return;
+
+    gre[6] = (realCallId>>0)&0xFF;
+    gre[7] = (realCallId>>8)&0xFF;
+
+    // Same header forwardGRE leaves behind, the kernel fills in id and checksum
+    uint8_t *ip = greHeaders + 20*nbGre;
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    ip[8] = 64;
+    ip[9] = 47;
+    ((uint16_t*)(ip+ 2))[0] = 20+n;
+    ((uint32_t*)(ip+12))[0] = out;
+    ((uint32_t*)(ip+16))[0] = dst;
+
+    memset(greTo+nbGre, 0, sizeof(greTo[0]));
+    greTo[nbGre].sin_family = AF_INET;
+    greTo[nbGre].sin_addr.s_addr = dst;
+    greIovs[2*nbGre+1].iov_base = gre;
+    greIovs[2*nbGre+1].iov_len = n;
+    if(++nbGre==UNWRAP_BATCH) flushGRE();
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::flushGRE()
+{
+    // Must happen before the buffer the frames sit in gets reused
+    int sent = 0;
+    while(sent<nbGre)
+    {
+        int count = sendmmsg(proxy->greSocket, greMsgs+sent, nbGre-sent, 0);
+        if(count<0 && errno==EINTR) continue;
+        if(count<=0) break;
+        sent += count;
+    }
+    if(sent<nbGre) proxy->FAIL(false, "sendmmsg", "reactor %d: sendmmsg failed on GRE socket", id);
+    nbGre = 0;
+}
+
+// -----------------------------------------------------------------------
+void *Proxy::Reactor::threadHead(
+    void    *vp
+)
+{
+    Reactor *reactor = (Reactor*)vp;
+    reactor->run();
+    return 0;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Reactor::start()
+{
+    DBGP("launching reactor %d", id);
+    proxy->startThread(threadHead, this, true, "reactor");
+}
@@ -0,0 +1,288 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+#include <time.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/nameser.h>
+
+// -----------------------------------------------------------------------
+// Peers given by name are looked up off the control path: all at once by a few
+// threads at startup, then each again by a background thread when what was
+// learnt about it runs out. Links pick up the current address of their server when
+// they connect, a change never touches links already up.
+
+// Threads looking names up at startup, at most
+#define RESOLVER_MAX_THREADS    16
+
+// A TTL shorter than this is stretched, a failed lookup is retried after that long
+#define RESOLVER_MIN_TTL        5
+#define RESOLVER_RETRY_DELAY    10
+
+// -----------------------------------------------------------------------
+static bool dnsTTL(
+    const char      *host,
+    Proxy::IPAddr   addr,
+    int             *ttl
+)
+{
+    // Ask DNS directly for what getaddrinfo() won't say: how long the answer holds
+    struct __res_state state;
+    memset(&state, 0, sizeof(state));
+    if(res_ninit(&state)<0) return false;
+
+    uint8_t answer[4096];
+    int n = res_nsearch(&state, host, ns_c_in, ns_t_a, answer, sizeof(answer));
+    res_nclose(&state);
+    if(n<NS_HFIXEDSZ) return false;
+    if((int)sizeof(answer)<n) n = sizeof(answer);
+
+    const uint8_t *end = answer + n;
+    const uint8_t *p = answer + NS_HFIXEDSZ;
+    int nbQuestions = (answer[4]<<8) | answer[5];
+    int nbAnswers = (answer[6]<<8) | answer[7];
+    for(int i=0; i<nbQuestions; ++i)
+    {
+        int skip = dn_skipname(p, end);
+        if(skip<0 || end<p+skip+NS_QFIXEDSZ) return false;
+        p += skip + NS_QFIXEDSZ;
+    }
+
+    // The shortest TTL on the way counts, CNAMEs included
+    bool found = false;
+    int shortest = -1;
+    for(int i=0; i<nbAnswers; ++i)
+    {
+        int skip = dn_skipname(p, end);
+        if(skip<0 || end<p+skip+NS_RRFIXEDSZ) return false;
+        p += skip;
+
+        int type = (p[0]<<8) | p[1];
+        int recordTTL = (p[4]<<24) | (p[5]<<16) | (p[6]<<8) | p[7];
+        int length = (p[8]<<8) | p[9];
+        p += NS_RRFIXEDSZ;
+        if(end<p+length) return false;
+
+        if(recordTTL<0) recordTTL = 0;
+        if(shortest<0 || recordTTL<shortest) shortest = recordTTL;
+        if(type==ns_t_a && length==4 && 0==memcmp(p, &addr, 4)) found = true;
+        p += length;
+    }
+
+    // An address DNS didn't give (/etc/hosts, say) gets no TTL
+    if(found==false) return false;
+    ttl[0] = shortest;
+    return true;
+}
+
+// -----------------------------------------------------------------------
+Proxy::Resolver::Resolver(
+    Proxy *_proxy
+)
+    :
+        proxy(_proxy),
+        next(0)
+{
+    int n = proxy->pairs.size();
+    for(int i=0; i<n; ++i)
+    {
+        Pair *pair = proxy->pairs[i];
+        int nbUpstreams = pair->getNbUpstreams();
+        for(int j=0; j<nbUpstreams; ++j)
+        {
+            if(pair->getUpstream(j).host==0) continue;
+            Name name;
+            name.pair = pair;
+            name.upstream = j;
+            name.due = 0;
+            names.push_back(name);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Resolver::lookup(
+    const char  *host,
+    IPAddr      *addr,
+    int         *ttl
+)
+{
+    // getaddrinfo() is reentrant and goes through nsswitch like gethostbyname() did:
+    // the address comes from it, whatever order /etc/nsswitch.conf puts sources in
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result = 0;
+    int r = getaddrinfo(host, 0, &hints, &result);
+    if(r!=0 || result==0)
+    {
+        proxy->FAIL(false, 0, "can't resolve IP for %s: %s", host, gai_strerror(r));
+        return false;
+    }
+    addr[0] = ((struct sockaddr_in*)result->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(result);
+
+    // The TTL only holds if DNS is where that address came from, a second query tells
+    if(dnsTTL(host, addr[0], ttl)==false) ttl[0] = -1;
+    else if(ttl[0]<RESOLVER_MIN_TTL) ttl[0] = RESOLVER_MIN_TTL;
+    return true;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Resolver::refresh(
+    int i
+)
+{
+    Name &name = names[i];
+    Pair *pair = name.pair;
+    int j = name.upstream;
+    const Pair::Upstream &up = pair->getUpstream(j);
+
+    IPAddr addr;
+    int ttl;
+    if(lookup(up.host, &addr, &ttl)==false)
+    {
+        // Whatever was known keeps being used meanwhile
+        name.due = proxy->now() + 1000*(uint64_t)RESOLVER_RETRY_DELAY;
+        return;
+    }
+
+    IPAddr old = pair->getPeerAddr(j);
+    pair->setPeerAddr(j, addr);
+    if(old!=addr)
+    {
+        proxy->INFO(
+            "peer %s now resolves to %s (was %s)",
+            up.name,
+            proxy->ipToStr(addr).c_str(),
+            old==INADDR_NONE ? "unresolved" : proxy->ipToStr(old).c_str()
+        );
+    }
+
+    // A TTL always says when to look again. Without one, --dnsRefresh does, and 0 says never
+    if(ttl<0) ttl = proxy->getDNSRefresh();
+    name.due = (ttl==0) ? 0 : proxy->now() + 1000*(uint64_t)ttl;
+    DBGP(
+        "peer %s: %s, next lookup in %d seconds",
+        up.name,
+        proxy->ipToStr(addr).c_str(),
+        name.due ? ttl : -1
+    );
+}
+
+// -----------------------------------------------------------------------
+void *Proxy::Resolver::startupHead(
+    void *vp
+)
+{
+    // Threads take names off the list until there are none left
+    Resolver *resolver = (Resolver*)vp;
+    int n = resolver->names.size();
+    while(1)
+    {
+        int i = __atomic_fetch_add(&resolver->next, 1, __ATOMIC_SEQ_CST);
+        if(n<=i) break;
+        resolver->refresh(i);
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Resolver::resolveAll()
+{
+    // Before daemonize(): the threads are gone by the time it forks
+    int n = names.size();
+    if(n<=0) return;
+
+    uint64_t start = proxy->now();
+    int nbThreads = n<RESOLVER_MAX_THREADS ? n : RESOLVER_MAX_THREADS;
+    std::vector<pthread_t> threads;
+    for(int i=0; i<nbThreads; ++i)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, 0, startupHead, this)!=0) break;
+        threads.push_back(thread);
+    }
+
+    // Not a single thread: this one does it all
+    if(threads.empty()) startupHead(this);
+    for(int i=0; i<(int)threads.size(); ++i) pthread_join(threads[i], 0);
+
+    for(int i=0; i<n; ++i)
+    {
+        Pair *pair = names[i].pair;
+        int j = names[i].upstream;
+        if(pair->getPeerAddr(j)!=INADDR_NONE) continue;
+        proxy->FAIL(
+            false,
+            0,
+            "couldn't resolve peer %s, no connection goes to it until it resolves",
+            pair->getUpstream(j).name
+        );
+    }
+
+    proxy->INFO(
+        "resolved %d peer name(s) with %d thread(s) in %d ms",
+        n,
+        (int)threads.size(),
+        (int)(proxy->now()-start)
+    );
+}
+
+// -----------------------------------------------------------------------
+void *Proxy::Resolver::threadHead(
+    void *vp
+)
+{
+    Resolver *resolver = (Resolver*)vp;
+    resolver->run();
+    return 0;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Resolver::run()
+{
+    while(1)
+    {
+        // One lookup at a time here, nobody waits on this thread
+        uint64_t t = proxy->now();
+        uint64_t wake = 0;
+        int n = names.size();
+        for(int i=0; i<n; ++i)
+        {
+            if(names[i].due!=0 && names[i].due<=t) refresh(i);
+            uint64_t due = names[i].due;
+            if(due!=0 && (wake==0 || due<wake)) wake = due;
+        }
+        if(wake==0) break;
+
+        t = proxy->now();
+        if(t<wake)
+        {
+            struct timespec ts;
+            ts.tv_sec = (wake-t)/1000;
+            ts.tv_nsec = ((wake-t)%1000)*1000000;
+            nanosleep(&ts, 0);
+        }
+    }
+    DBGP("nothing left to resolve, resolver thread exits");
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Resolver::start()
+{
+    if(names.empty()) return;
+
+    DBGP("launching resolver thread for %d peer name(s)", (int)names.size());
+    if(proxy->startThread(threadHead, this, false, "resolver")==false) proxy->INFO("peer addresses won't be refreshed");
+}
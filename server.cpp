@@ -5,176 +5,216 @@
 
 #include <proxy.h>
 #include <errno.h>
+#include <signal.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 
-#if defined(__CYGWIN__)
-    #include <sys/select.h>
-#endif
+// -----------------------------------------------------------------------
+static volatile sig_atomic_t statsRequested = 0;
+static volatile sig_atomic_t flushRequested = 0;
+static volatile sig_atomic_t reloadRequested = 0;
 
 // -----------------------------------------------------------------------
-static inline void addSocket(
-    int    socket,
-    int    *max,
-    fd_set *readSet,
-    fd_set *exceptionSet
+static void requestStats(
+    int
 )
 {
-    if(max[0]<socket) max[0] = socket;
-    FD_SET(socket,exceptionSet);
-    FD_SET(socket,readSet);
+    statsRequested = 1;
 }
 
 // -----------------------------------------------------------------------
-void Proxy::server()
+static void requestFlush(
+    int
+)
 {
-    DBG("TCP thread: up and running -- waiting for inbound TCP connections");
+    flushRequested = 1;
+}
 
-    fd_set readSet;
-    fd_set exceptionSet;
-    std::vector<int> deadLinks;
-    std::vector<Link*> newLinks;
-    while(1)
-    {
-        int i;
-        int n;
-        int max = -1;
-        FD_ZERO(&readSet);
-        FD_ZERO(&exceptionSet);
-
-        n = pairs.size();
-        for(i=0; i<n; ++i)
-        {
-            addSocket(
-                pairs[i]->getSocket(),
-                &max,
-                &readSet,
-                &exceptionSet
-            );
-        }
+// -----------------------------------------------------------------------
+static void requestReload(
+    int
+)
+{
+    reloadRequested = 1;
+}
 
-        enterDBReadOnly();
-            n = links.size();
-            for(i = 0;i<n;++i)
+// -----------------------------------------------------------------------
+// What SIGUSR1 logs about a link, copied out so that the logging and the bpf
+// lookups happen with the link table unlocked
+struct LinkStats
+{
+    std::string             callerName;
+    std::string             peerName;
+    int                     reactor;
+    int                     toCallerQueued;
+    int                     toCalleeQueued;
+    uint32_t                highWaterHits;
+    uint32_t                drops;
+    Proxy::IPAddr           callerIP;
+    Proxy::IPAddr           calleeIP;
+    std::vector<Proxy::CallId> toCallerIds;
+    std::vector<Proxy::CallId> toCalleeIds;
+};
+
+// -----------------------------------------------------------------------
+void Proxy::dumpStats()
+{
+    // Reactors wait on this lock to publish links and calls: it is only held for the copy
+    std::vector<LinkStats> stats;
+    enterDBReadWrite();
+        int n = links.size();
+        stats.resize(n);
+        for(int i=0; i<n; ++i)
+        {
+            Link *link = links[i];
+            LinkStats &s = stats[i];
+            s.callerName = link->getCallerName();
+            s.peerName = link->getPeerName();
+            s.reactor = link->getReactor()->getId();
+            link->getQueued(&s.toCallerQueued, &s.toCalleeQueued);
+            s.highWaterHits = link->getHighWaterHits();
+            s.drops = link->getDrops();
+            s.callerIP = link->getCallerIP();
+            s.calleeIP = link->getCalleeIP();
+
+            if(offloadMap<0) continue;
+            int nbCalls = link->getNbCalls();
+            for(int j=0; j<nbCalls; ++j)
             {
-                addSocket(
-                    links[i]->getCallerSocket(),
-                    &max,
-                    &readSet,
-                    &exceptionSet
-                );
-                addSocket(
-                    links[i]->getCalleeSocket(),
-                    &max,
-                    &readSet,
-                    &exceptionSet
-                );
+                const Link::Call &call = link->getCall(j);
+                s.toCallerIds.push_back(call.fakeCallerId);
+                s.toCalleeIds.push_back(call.fakeCalleeId);
             }
-        leaveDBReadOnly();
+        }
+    leaveDBReadWrite();
 
-        int ret = select(1+max, &readSet, 0, &exceptionSet, 0);
+    INFO("statistics for %d live links follow", n);
+    for(int i=0; i<n; ++i)
+    {
+        const LinkStats &s = stats[i];
+        INFO(
+            "link %s -> %s on reactor %d: %d/%d bytes queued to caller/callee, %u high water hits, %u dropped packets",
+            s.callerName.c_str(),
+            s.peerName.c_str(),
+            s.reactor,
+            s.toCallerQueued,
+            s.toCalleeQueued,
+            s.highWaterHits,
+            s.drops
+        );
+
+        if(offloadMap<0) continue;
+        uint64_t toCallerPackets = 0;
+        uint64_t toCallerBytes = 0;
+        uint64_t toCalleePackets = 0;
+        uint64_t toCalleeBytes = 0;
+        int nbCalls = s.toCallerIds.size();
+        for(int j=0; j<nbCalls; ++j)
+        {
+            offloadCounters(s.calleeIP, s.toCallerIds[j], &toCallerPackets, &toCallerBytes);
+            offloadCounters(s.callerIP, s.toCalleeIds[j], &toCalleePackets, &toCalleeBytes);
+        }
+        INFO(
+            "link %s -> %s offloaded (%d calls): %llu packets/%llu bytes to caller, %llu packets/%llu bytes to callee",
+            s.callerName.c_str(),
+            s.peerName.c_str(),
+            nbCalls,
+            (unsigned long long)toCallerPackets,
+            (unsigned long long)toCallerBytes,
+            (unsigned long long)toCalleePackets,
+            (unsigned long long)toCalleeBytes
+        );
+    }
 
-        if(ret<0 && errno!=EINTR && errno!=EAGAIN)
+    int nbPairs = pairs.size();
+    for(int i=0; i<nbPairs; ++i)
+    {
+        Pair *pair = pairs[i];
+        int nbUpstreams = pair->getNbUpstreams();
+        if(nbUpstreams<=1) continue;
+        for(int j=0; j<nbUpstreams; ++j)
         {
-            FAIL(
-                false,
-                "select",
-                "select failed !\n"
+            const Pair::Upstream &up = pair->getUpstream(j);
+            INFO(
+                "server %s of %s: %s, %d links, %d calls",
+                up.name,
+                pair->getListenName(),
+                pair->isHealthy(j) ? "up" : "down",
+                __atomic_load_n(&up.nbLinks, __ATOMIC_RELAXED),
+                __atomic_load_n(&up.nbCalls, __ATOMIC_RELAXED)
             );
         }
-        else if(0<ret)
-        {
-            n = pairs.size();
-            for(i=0; i<n; ++i)
-            {
-                int s = pairs[i]->getSocket();
-                if(FD_ISSET(s,&readSet))
-                {
-                    DBG(
-                        "new link request on interface %s, proxying to %s",
-                        pairs[i]->getListenName(),
-                        pairs[i]->getPeerName()
-                    );
-
-                    bool newLinkOK = true;
-                    Link *newLink = new Link(this,i);
-                    newLinkOK = newLinkOK && newLink->getCallerSocket()>=0;
-                    newLinkOK = newLinkOK && newLink->getCalleeSocket()>=0;
-
-                    DBG(
-                        "new link request on interface %s %s.",
-                        pairs[i]->getListenName(),
-                        newLinkOK ? "suceeded" : "failed"
-                    );
-
-                    if(newLinkOK) newLinks.push_back(newLink);
-                    else          delete newLink;
-                }
-                if(FD_ISSET(s, &exceptionSet))
-                {
-                    FAIL(
-                        false,
-                        "select",
-                        "exception on listen socket %s -> %s!\n",
-                        pairs[i]->getListenName(),
-                        pairs[i]->getPeerName()
-                    );
-                }
-            }
+    }
 
-            enterDBReadOnly();
-                i = links.size();
-                while(i--)
-                {
-                    bool linkOK = true;
-                    int s1 = links[i]->getCallerSocket();
-                    int s2 = links[i]->getCalleeSocket();
-                    if(FD_ISSET(s1, &readSet)) linkOK = linkOK && links[i]->tcpPacket(true);
-                    if(FD_ISSET(s2, &readSet)) linkOK = linkOK && links[i]->tcpPacket(false);
-                    if(FD_ISSET(s1, &exceptionSet)) linkOK = false;
-                    if(FD_ISSET(s2, &exceptionSet)) linkOK = false;
-
-                    if(linkOK==false)
-                    {
-                        DBG(
-                            //false,
-                            //0,
-                            "exception on tcp link %s -> %s.",
-                            ipToStr(links[i]->getCallerIP()).c_str(),
-                            links[i]->getPeerName()
-                        );
-                        deadLinks.push_back(i);
-                    }
-                }
-            leaveDBReadOnly();
-
-            int n1 = newLinks.size();
-            int n2 = deadLinks.size();
-            if(n1!=0 || n2!=0)
-            {
-                enterDBReadWrite();
-                    while(n1--) links.push_back(newLinks[n1]);
-                    while(n2--)
-                    {
-                        int i = deadLinks[n2];
-                        DBG(
-                            "removing links[%d] = %s -> %s",
-                            i,
-                            links[i]->getCallerName(),
-                            links[i]->getPeerName()
-                        );
-
-                        Link *link = links[i];
-                        links[i] = links[links.size()-1];
-                        links.pop_back();
-                        delete link;
-                    }
-                leaveDBReadWrite();
-                deadLinks.clear();
-                newLinks.clear();
-            }
-        }
+    if(aclCache.isEnabled())
+    {
+        int size;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t flushes;
+        aclCache.getStats(&size, &hits, &misses, &evictions, &flushes);
+        INFO(
+            "ACL cache: %d verdicts, %llu hits, %llu misses, %llu evictions, %llu flushes",
+            size,
+            (unsigned long long)hits,
+            (unsigned long long)misses,
+            (unsigned long long)evictions,
+            (unsigned long long)flushes
+        );
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::checkSignals()
+{
+    if(statsRequested)
+    {
+        statsRequested = 0;
+        dumpStats();
+    }
+
+    if(flushRequested)
+    {
+        flushRequested = 0;
+        aclCache.flush();
+        INFO("ACL cache flushed, connections get checked again");
+    }
+
+    if(reloadRequested)
+    {
+        reloadRequested = 0;
+        INFO("reloading ACL prefixes");
+        reloadACLTable();
     }
 }
 
+// -----------------------------------------------------------------------
+void Proxy::server()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStats;
+    if(sigaction(SIGUSR1, &action, 0)<0) FAIL(false, "sigaction", "couldn't install SIGUSR1 handler");
+    action.sa_handler = requestFlush;
+    if(sigaction(SIGUSR2, &action, 0)<0) FAIL(false, "sigaction", "couldn't install SIGUSR2 handler");
+    action.sa_handler = requestReload;
+    if(sigaction(SIGHUP , &action, 0)<0) FAIL(false, "sigaction", "couldn't install SIGHUP handler");
+
+    // Several reactors need one SO_REUSEPORT listen socket each on every pair
+    int n = pairs.size();
+    for(int i=0; i<n; ++i)
+    {
+        if(pairs[i]->shareSockets(nbReactors)==false)
+        {
+            FAIL(true, 0, "couldn't share listen socket %s among %d reactors", pairs[i]->getListenName(), nbReactors);
+        }
+    }
+
+    DBG("TCP side: starting %d reactor(s)", nbReactors);
+    for(int i=0; i<nbReactors; ++i) reactors.push_back(new Reactor(this, i));
+    for(int i=1; i<nbReactors; ++i) reactors[i]->start();
+    reactors[0]->run();
+}
@@ -0,0 +1,311 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+// -----------------------------------------------------------------------
+// Chained proxies that both run a trunk send each other GRE as UDP datagrams,
+// one bare GRE packet per datagram, call id set for the receiving proxy just
+// like a PPTP-IN-TCP frame. Unlike GRE, UDP has ports: every GRE thread sends
+// from a port of its own and the receiving end spreads them over a group of
+// SO_REUSEPORT sockets, so NICs and the kernel can spread trunks across cores.
+
+#ifndef SOL_UDP
+    #define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT
+    #define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+    #define UDP_GRO 104
+#endif
+
+// What a single segmented send may carry, well under the kernel's own limits
+#define TRUNK_MAX_SEGMENTS  64
+#define TRUNK_MAX_GSO       60000
+
+// -----------------------------------------------------------------------
+int Proxy::makeTrunkSocket(
+    bool receive
+)
+{
+    int s = makeSocket(SOCK_DGRAM, IPPROTO_UDP, true);
+
+    // Senders keep whatever port the kernel hands them, one per GRE thread
+    if(receive)
+    {
+        int on = 1;
+        if(setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))<0)
+        {
+            FAIL(true, "setsockopt", "setsockopt(SO_REUSEPORT) failed on UDP trunk socket");
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(trunkPort);
+        if(bind(s, (struct sockaddr*)&addr, sizeof(addr))<0)
+        {
+            FAIL(true, "bind", "couldn't bind UDP trunk socket to port %u", trunkPort);
+        }
+
+        #if defined(linux)
+            // Coalesced datagrams are split again on our side, one system call for many packets
+            if(setsockopt(s, SOL_UDP, UDP_GRO, &on, sizeof(on))<0)
+            {
+                DBG("UDP GRO not supported, trunk datagrams come in one by one");
+            }
+        #endif
+    }
+
+    setNonBlocking(s, false, true);
+    DBG("UDP trunk socket sucessfully created (descriptor = %d)", s);
+    return s;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::startTrunk()
+{
+    #if !defined(linux)
+        trunkGSO = false;
+    #endif
+
+    // One receiving thread per GRE thread, each with its own socket in the port's group
+    if(trunkPort==0) return;
+    for(int i=0; i<greThreads; ++i)
+    {
+        int rx = makeTrunkSocket(true);
+        trunkSockets.push_back(rx);
+
+        GREWorker *worker = new GREWorker(this, greWorkers.size(), rx, makeGRESocket(false), 0, 0, makeTrunkSocket(false), true);
+        greWorkers.push_back(worker);
+        worker->start();
+    }
+    INFO("UDP trunk: offering chained proxies to carry GRE over UDP port %u", trunkPort);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::GREWorker::trunkOut(
+    uint8_t                     *buf,
+    int                         n,
+    const struct sockaddr_in    *dst
+)
+{
+    // forwardGRE left the IP header as it would for raw GRE, only its source matters here
+    if(nbTrunk==batch) flushTrunk();
+
+    int headerSize = (buf[0]&0x0F)*4;
+    trunkIovs[nbTrunk].iov_base = buf + headerSize;
+    trunkIovs[nbTrunk].iov_len = n - headerSize;
+    trunkTo[nbTrunk] = dst[0];
+    trunkFrom[nbTrunk] = ((uint32_t*)(buf+12))[0];
+    ++nbTrunk;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::GREWorker::flushTrunk()
+{
+    int first = 0;
+    bool ok = true;
+    while(ok && first<nbTrunk)
+    {
+        // Datagrams to the same trunk and of the same size, but for a shorter last one,
+        // go out as one segmented send straight from the iovecs they already sit in
+        int nbMsgs = 0;
+        bool gso = __atomic_load_n(&proxy->trunkGSO, __ATOMIC_RELAXED);
+        for(int i=first; i<nbTrunk; ++nbMsgs)
+        {
+            int size = trunkIovs[i].iov_len;
+            int total = size;
+            int count = 1;
+            while(
+                gso                                                         &&
+                i+count<nbTrunk                                             &&
+                count<TRUNK_MAX_SEGMENTS                                    &&
+                trunkTo[i+count].sin_addr.s_addr==trunkTo[i].sin_addr.s_addr &&
+                trunkTo[i+count].sin_port==trunkTo[i].sin_port              &&
+                trunkFrom[i+count]==trunkFrom[i]                            &&
+                (int)trunkIovs[i+count].iov_len<=size                       &&
+                total+(int)trunkIovs[i+count].iov_len<=TRUNK_MAX_GSO
+            )
+            {
+                int last = trunkIovs[i+count].iov_len;
+                total += last;
+                ++count;
+                if(last<size) break;
+            }
+
+            struct msghdr *hdr = &trunkMsgs[nbMsgs].msg_hdr;
+            memset(hdr, 0, sizeof(*hdr));
+            hdr->msg_name = trunkTo + i;
+            hdr->msg_namelen = sizeof(trunkTo[i]);
+            hdr->msg_iov = trunkIovs + i;
+            hdr->msg_iovlen = count;
+
+            #if defined(linux)
+                // Leave from the address the peer proxy expects its GRE from
+                uint8_t *control = trunkControl + nbMsgs*TRUNK_CONTROL_SIZE;
+                memset(control, 0, TRUNK_CONTROL_SIZE);
+                hdr->msg_control = control;
+                hdr->msg_controllen = TRUNK_CONTROL_SIZE;
+
+                size_t used = 0;
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+                if(trunkFrom[i]!=0 && trunkFrom[i]!=(IPAddr)~0)
+                {
+                    cmsg->cmsg_level = IPPROTO_IP;
+                    cmsg->cmsg_type = IP_PKTINFO;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+                    struct in_pktinfo *info = (struct in_pktinfo*)CMSG_DATA(cmsg);
+                    info->ipi_spec_dst.s_addr = trunkFrom[i];
+                    used += CMSG_SPACE(sizeof(struct in_pktinfo));
+                    cmsg = CMSG_NXTHDR(hdr, cmsg);
+                }
+                if(1<count)
+                {
+                    cmsg->cmsg_level = SOL_UDP;
+                    cmsg->cmsg_type = UDP_SEGMENT;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                    *(uint16_t*)CMSG_DATA(cmsg) = size;
+                    used += CMSG_SPACE(sizeof(uint16_t));
+                }
+                hdr->msg_controllen = used;
+                if(used==0) hdr->msg_control = 0;
+            #endif
+
+            trunkStarts[nbMsgs] = i;
+            i += count;
+        }
+
+        int sent = 0;
+        while(sent<nbMsgs)
+        {
+            int count = sendmmsg(trunkSocket, trunkMsgs+sent, nbMsgs-sent, 0);
+            if(count<0 && errno==EINTR) continue;
+            if(count<=0) break;
+            sent += count;
+        }
+        if(sent==nbMsgs) break;
+
+        // Segmentation needs checksum offload on the way out, without it the kernel refuses
+        if(gso && 1<trunkMsgs[sent].msg_hdr.msg_iovlen && (errno==EIO || errno==EINVAL || errno==ENOPROTOOPT))
+        {
+            proxy->FAIL(false, "sendmmsg", "UDP segmentation refused, trunk falls back to one datagram per packet");
+            __atomic_store_n(&proxy->trunkGSO, false, __ATOMIC_RELAXED);
+            first = trunkStarts[sent];
+            continue;
+        }
+
+        proxy->FAIL(false, "sendmmsg", "sendmmsg failed on UDP trunk socket");
+        ok = false;
+    }
+
+    nbTrunk = 0;
+    return ok;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::GREWorker::runTrunk()
+{
+    uint8_t *bufs = new uint8_t[TRUNK_BATCH*TRUNK_BUFFER_SIZE];
+    uint8_t *controls = new uint8_t[TRUNK_BATCH*TRUNK_CONTROL_SIZE];
+    struct mmsghdr *inMsgs = new struct mmsghdr[TRUNK_BATCH];
+    struct iovec *inIovs = new struct iovec[TRUNK_BATCH];
+    struct sockaddr_in *from = new struct sockaddr_in[TRUNK_BATCH];
+
+    // Each packet gets an IP header in front so that it looks like GRE read off a raw socket
+    uint8_t *packets = new uint8_t[batch*GRE_BUFFER_SIZE];
+
+    while(1)
+    {
+        memset(inMsgs, 0, TRUNK_BATCH*sizeof(inMsgs[0]));
+        for(int i=0; i<TRUNK_BATCH; ++i)
+        {
+            inIovs[i].iov_base = bufs + i*TRUNK_BUFFER_SIZE;
+            inIovs[i].iov_len = TRUNK_BUFFER_SIZE;
+            inMsgs[i].msg_hdr.msg_iov = inIovs + i;
+            inMsgs[i].msg_hdr.msg_iovlen = 1;
+            inMsgs[i].msg_hdr.msg_name = from + i;
+            inMsgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            inMsgs[i].msg_hdr.msg_control = controls + i*TRUNK_CONTROL_SIZE;
+            inMsgs[i].msg_hdr.msg_controllen = TRUNK_CONTROL_SIZE;
+        }
+
+        int got = recvmmsg(rxSocket, inMsgs, TRUNK_BATCH, MSG_WAITFORONE, 0);
+        if(got<0)
+        {
+                 if(errno==EINTR)   continue;
+            else if(errno==EAGAIN)  continue;
+            else
+            {
+                proxy->FAIL(false, "recvmmsg", "recvmmsg failed on UDP trunk socket");
+                break;
+            }
+        }
+
+        bool ok = true;
+        int slot = 0;
+        proxy->epoch.enter(reader);
+            for(int i=0; ok && i<got; ++i)
+            {
+                // With GRO, one datagram holds several packets of the given size, the last one maybe shorter
+                struct msghdr *hdr = &inMsgs[i].msg_hdr;
+                int n = inMsgs[i].msg_len;
+                int segment = n;
+                #if defined(linux)
+                    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg!=0; cmsg = CMSG_NXTHDR(hdr, cmsg))
+                    {
+                        if(cmsg->cmsg_level==SOL_UDP && cmsg->cmsg_type==UDP_GRO)
+                        {
+                            int gsoSize;
+                            memcpy(&gsoSize, CMSG_DATA(cmsg), sizeof(gsoSize));
+                            if(0<gsoSize) segment = gsoSize;
+                        }
+                    }
+                #endif
+
+                IPAddr src = from[i].sin_addr.s_addr;
+                uint8_t *p = (uint8_t*)inIovs[i].iov_base;
+                for(int offset=0; ok && offset<n; offset+=segment)
+                {
+                    int size = n-offset<segment ? n-offset : segment;
+                    uint8_t *gre = p + offset;
+                    if(size<8 || GRE_BUFFER_SIZE<20+size) continue;
+                    if(gre[2]!=0x88 || gre[3]!=0x0B) continue;      // Not PPP in GRE, not from a trunk
+
+                    if(slot==batch)
+                    {
+                        ok = flush();
+                        slot = 0;
+                    }
+
+                    uint8_t *ip = packets + slot*GRE_BUFFER_SIZE;
+                    memset(ip, 0, 20);
+                    ip[0] = 0x45;
+                    ip[8] = 64;
+                    ip[9] = 47;
+                    ((uint16_t*)(ip+ 2))[0] = 20+size;
+                    ((uint32_t*)(ip+12))[0] = src;
+                    memcpy(ip+20, gre, size);
+                    forward(ip, 20+size);
+                    ++slot;
+                }
+            }
+        proxy->epoch.leave(reader);
+        if(ok) ok = flush();
+        if(ok==false) break;
+    }
+}
@@ -0,0 +1,387 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+
+#if defined(linux)
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+// -----------------------------------------------------------------------
+// Everything below is needed: multishot recv is the most recent of them (Linux 6.0)
+#define URING_FEATURES  (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG)
+
+// -----------------------------------------------------------------------
+Proxy::Uring::Uring(
+    Proxy   *_proxy
+)
+    :
+        proxy(_proxy),
+        fd(-1),
+        sqMap(0),
+        sqMapSize(0),
+        sqTail(0),
+        sqArray(0),
+        sqMask(0),
+        sqEntries(0),
+        sqLocalTail(0),
+        toSubmit(0),
+        sqes(0),
+        cqMap(0),
+        cqMapSize(0),
+        cqHead(0),
+        cqTail(0),
+        cqMask(0),
+        cqes(0),
+        bufRing(0),
+        buffers(0),
+        bufferSize(0),
+        nbBuffers(0),
+        bufTail(0)
+{
+}
+
+// -----------------------------------------------------------------------
+Proxy::Uring::~Uring()
+{
+    if(sqes) munmap(sqes, sqEntries*sizeof(struct io_uring_sqe));
+    if(sqMap) munmap(sqMap, sqMapSize);
+    if(bufRing) munmap(bufRing, nbBuffers*sizeof(struct io_uring_buf));
+    if(0<=fd) close(fd);
+    delete [] buffers;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Uring::open(
+    int entries,
+    int _nbBuffers,
+    int _bufferSize
+)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4*entries;
+
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd<0)
+    {
+        proxy->FAIL(false, "io_uring_setup", "couldn't create io_uring instance");
+        return false;
+    }
+    if((params.features & URING_FEATURES)!=URING_FEATURES)
+    {
+        proxy->FAIL(false, 0, "io_uring instance lacks needed features (0x%X)", params.features);
+        return false;
+    }
+
+    // Submission and completion rings share a single mapping, the SQE array has its own
+    sqMapSize = params.sq_off.array + params.sq_entries*sizeof(uint32_t);
+    cqMapSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if(sqMapSize<cqMapSize) sqMapSize = cqMapSize;
+    void *map = mmap(0, sqMapSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(map==MAP_FAILED)
+    {
+        sqMap = 0;
+        proxy->FAIL(false, "mmap", "couldn't map io_uring rings");
+        return false;
+    }
+    sqMap = cqMap = (uint8_t*)map;
+
+    sqEntries = params.sq_entries;
+    map = mmap(0, sqEntries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(map==MAP_FAILED)
+    {
+        proxy->FAIL(false, "mmap", "couldn't map io_uring submission entries");
+        return false;
+    }
+    sqes = (struct io_uring_sqe*)map;
+
+    sqTail = (uint32_t*)(sqMap + params.sq_off.tail);
+    sqArray = (uint32_t*)(sqMap + params.sq_off.array);
+    sqMask = *(uint32_t*)(sqMap + params.sq_off.ring_mask);
+    sqLocalTail = *sqTail;
+    for(uint32_t i=0; i<sqEntries; ++i) sqArray[i] = i;
+
+    cqHead = (uint32_t*)(cqMap + params.cq_off.head);
+    cqTail = (uint32_t*)(cqMap + params.cq_off.tail);
+    cqMask = *(uint32_t*)(cqMap + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cqMap + params.cq_off.cqes);
+
+    if(_nbBuffers==0) return true;
+
+    // Provided buffers: receives pick one when data shows up, not when they get queued
+    nbBuffers = _nbBuffers;
+    bufferSize = _bufferSize;
+    map = mmap(0, nbBuffers*sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(map==MAP_FAILED)
+    {
+        proxy->FAIL(false, "mmap", "couldn't allocate io_uring buffer ring");
+        return false;
+    }
+    bufRing = (struct io_uring_buf*)map;
+    buffers = new uint8_t[nbBuffers*bufferSize];
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+    reg.ring_entries = nbBuffers;
+    reg.bgid = 0;
+    if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1)<0)
+    {
+        proxy->FAIL(false, "io_uring_register", "couldn't register io_uring buffer ring");
+        return false;
+    }
+
+    for(int i=0; i<nbBuffers; ++i) recycle(i);
+    __atomic_store_n(&bufRing[0].resv, bufTail, __ATOMIC_RELEASE);
+    return true;
+}
+
+// -----------------------------------------------------------------------
+struct io_uring_sqe *Proxy::Uring::getSqe()
+{
+    // Only ever full when a single tick queues more than the ring holds
+    if(toSubmit==sqEntries) enter(0, 0);
+
+    struct io_uring_sqe *sqe = sqes + (sqLocalTail & sqMask);
+    memset(sqe, 0, sizeof(*sqe));
+    ++sqLocalTail;
+    ++toSubmit;
+    return sqe;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::Uring::enter(
+    int waitFor,
+    int timeout
+)
+{
+    // Recycled buffers and new requests both become visible to the kernel here, once per tick
+    if(bufRing) __atomic_store_n(&bufRing[0].resv, bufTail, __ATOMIC_RELEASE);
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if(0<=timeout)
+    {
+        ts.tv_sec = timeout/1000;
+        ts.tv_nsec = (timeout%1000)*1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    uint32_t flags = IORING_ENTER_EXT_ARG;
+    if(0<waitFor) flags |= IORING_ENTER_GETEVENTS;
+    int r = syscall(__NR_io_uring_enter, fd, toSubmit, waitFor, flags, &arg, sizeof(arg));
+    if(r<0)
+    {
+        if(errno==EINTR || errno==ETIME || errno==EAGAIN || errno==EBUSY) return 0;
+        proxy->FAIL(false, "io_uring_enter", "io_uring_enter failed");
+        return -1;
+    }
+
+    toSubmit -= r;
+    return r;
+}
+
+// -----------------------------------------------------------------------
+struct io_uring_cqe *Proxy::Uring::peek()
+{
+    uint32_t head = *cqHead;
+    if(head==__atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return 0;
+    return cqes + (head & cqMask);
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Uring::advance()
+{
+    __atomic_store_n(cqHead, *cqHead+1, __ATOMIC_RELEASE);
+}
+
+// -----------------------------------------------------------------------
+uint8_t *Proxy::Uring::getBuffer(
+    int bid
+)
+{
+    return buffers + bid*bufferSize;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Uring::recycle(
+    int bid
+)
+{
+    // The ring tail lives in the first entry's reserved field: never write that one whole
+    struct io_uring_buf *buf = bufRing + (bufTail & (nbBuffers-1));
+    buf->addr = (uint64_t)(uintptr_t)getBuffer(bid);
+    buf->len = bufferSize;
+    buf->bid = bid;
+    ++bufTail;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Uring::prepAccept(
+    int         s,
+    uint64_t    tag
+)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = tag;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Uring::prepRecv(
+    int         s,
+    uint64_t    tag
+)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = tag;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Uring::prepSend(
+    int         s,
+    const void  *p,
+    int         n,
+    bool        linked,
+    uint64_t    tag
+)
+{
+    // MSG_WAITALL has the kernel retry short writes, so a linked send never starts early
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = s;
+    sqe->addr = (uint64_t)(uintptr_t)p;
+    sqe->len = n;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = linked ? IOSQE_IO_LINK : 0;
+    sqe->user_data = tag;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Uring::prepSendMsg(
+    int                 s,
+    const struct msghdr *msg,
+    uint64_t            tag
+)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = s;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->user_data = tag;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Uring::prepPoll(
+    int         s,
+    uint32_t    events,
+    uint64_t    tag
+)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s;
+    sqe->poll32_events = events;
+    sqe->user_data = tag;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Uring::prepRead(
+    int         s,
+    void        *p,
+    int         n,
+    uint64_t    tag
+)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = s;
+    sqe->addr = (uint64_t)(uintptr_t)p;
+    sqe->len = n;
+    sqe->user_data = tag;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Uring::prepCancel(
+    uint64_t tag
+)
+{
+    // Cancellations complete with tag 0, which no other request ever uses
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = 0;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::Uring::prepCancelSocket(
+    int s
+)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = s;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = 0;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::Uring::probe(
+    Proxy   *proxy
+)
+{
+    // Old kernels only reject a multishot recv once it runs, so try one for real
+    Uring uring(proxy);
+    if(uring.open(8, 8, 64)==false) return false;
+
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair)<0) return false;
+
+    uring.prepRecv(pair[0], 1);
+    bool ok = (1==write(pair[1], "x", 1)) && 0<=uring.enter(1, 1000);
+    struct io_uring_cqe *cqe = ok ? uring.peek() : 0;
+    ok =
+        cqe!=0                                  &&
+        cqe->res==1                             &&
+        (cqe->flags & IORING_CQE_F_BUFFER)      &&
+        (cqe->flags & IORING_CQE_F_MORE);
+
+    close(pair[0]);
+    close(pair[1]);
+    return ok;
+}
+
+#else // linux
+
+// -----------------------------------------------------------------------
+bool Proxy::Uring::probe(
+    Proxy   *
+)
+{
+    return false;
+}
+
+#endif // linux
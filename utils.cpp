@@ -9,9 +9,11 @@
 #include <netdb.h>
 #include <proxy.h>
 #include <signal.h>
+#include <pthread.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
@@ -100,11 +102,11 @@ void Proxy::daemonize()
     if(noFork==true) return;
     daemonized = true;
 
-    if(signal(SIGHUP , SIG_IGN)<0) FAIL(true, "signal", "SIGHUP ");
-    if(signal(SIGALRM, SIG_IGN)<0) FAIL(true, "signal", "SIGALRM");
-    if(signal(SIGPIPE, SIG_IGN)<0) FAIL(true, "signal", "SIGPIPE");
-    if(signal(SIGUSR1, SIG_IGN)<0) FAIL(true, "signal", "SIGUSR1");
-    if(signal(SIGUSR2, SIG_IGN)<0) FAIL(true, "signal", "SIGUSR2");
+    if(signal(SIGHUP , SIG_IGN)==SIG_ERR) FAIL(true, "signal", "SIGHUP ");
+    if(signal(SIGALRM, SIG_IGN)==SIG_ERR) FAIL(true, "signal", "SIGALRM");
+    if(signal(SIGPIPE, SIG_IGN)==SIG_ERR) FAIL(true, "signal", "SIGPIPE");
+    if(signal(SIGUSR1, SIG_IGN)==SIG_ERR) FAIL(true, "signal", "SIGUSR1");
+    if(signal(SIGUSR2, SIG_IGN)==SIG_ERR) FAIL(true, "signal", "SIGUSR2");
     if(chdir("/")<0)               FAIL(true, "chdir ", "chdir(/)");
 
     umask(0);
@@ -171,6 +173,51 @@ bool Proxy::setNonBlocking(
     return true;
 }
 
+// -----------------------------------------------------------------------
+bool Proxy::startThread(
+    void        *(*head)(void*),
+    void        *arg,
+    bool        fatal,
+    const char  *what
+)
+{
+    // Signals are for the first reactor, which runs on the main thread: every other
+    // thread inherits a mask that blocks them. None of them is ever joined
+    sigset_t mask;
+    sigset_t savedMask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, &savedMask);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int r = pthread_create(&thread, &attr, head, arg);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &savedMask, 0);
+    if(r==0) return true;
+
+    errno = r;
+    FAIL(
+        fatal,
+        "pthread_create",
+        "couldn't start %s thread",
+        what
+    );
+    return false;
+}
+
+// -----------------------------------------------------------------------
+uint64_t Proxy::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000*(uint64_t)ts.tv_sec + ts.tv_nsec/1000000;
+}
+
 // -----------------------------------------------------------------------
 std::string Proxy::ipToStr(
     IPAddr ip
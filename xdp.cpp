@@ -0,0 +1,348 @@
+/*
+ * This file is part of pptpproxy
+ * and is in the public domain
+ */
+
+#include <proxy.h>
+
+#if defined(linux)
+
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/if_ether.h>
+
+// -----------------------------------------------------------------------
+#ifndef AF_XDP
+    #define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+    #define SOL_XDP 283
+#endif
+
+// One UMEM per socket: every frame sits either in the fill ring or in the RX ring
+#define XDP_FRAME_SIZE      2048
+#define XDP_RING_SIZE       2048
+#define XDP_MAX_CALLS       65536
+
+// -----------------------------------------------------------------------
+int Proxy::xdpProgram(
+    int xskMap
+)
+{
+    // Redirect unfragmented, option-less IPv4 GRE from a known (source, call id) to the
+    // socket of the receiving queue, everything else goes on to the kernel stack
+    std::vector<struct bpf_insn> prog;
+    std::vector<int> toPass;
+
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0));                 // r6 = ctx
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 2, 1, 0, 0));                    // r2 = data
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 3, 1, 4, 0));                    // r3 = data_end
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 14+20+8));            // eth + ip + gre
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 0, 0));
+
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 12, 0));                   // ethertype
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0, htons(ETH_P_IP)));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_B, 4, 2, 14, 0));                   // version, header length
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0, 0x45));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_B, 4, 2, 14+9, 0));                 // protocol
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0, 47));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 14+6, 0));                 // fragment bits
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_AND | BPF_K, 4, 0, 0, htons(0x3FFF)));
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 14+20+2, 0));              // GRE protocol
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 0, htons(0x880B)));
+
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 4, 2, 14+12, 0));                // key.src
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 10, 4, -8, 0));
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 14+20+6, 0));              // key.callId
+    prog.push_back(bpfInsn(BPF_STX | BPF_MEM | BPF_W, 10, 4, -4, 0));
+
+    bpfLoadMap(prog, 1, xdpCallMap);
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0));
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -8));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+    toPass.push_back(prog.size());
+    prog.push_back(bpfInsn(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0, 0));
+
+    bpfLoadMap(prog, 1, xskMap);
+    prog.push_back(bpfInsn(BPF_LDX | BPF_MEM | BPF_W, 2, 6, 16, 0));                   // rx_queue_index
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS));           // if no socket there
+    prog.push_back(bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    int pass = prog.size();
+    prog.push_back(bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS));
+    prog.push_back(bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    int n = toPass.size();
+    for(int i=0; i<n; ++i) prog[toPass[i]].off = pass - (toPass[i]+1);
+    return bpfProgLoad(BPF_PROG_TYPE_XDP, &prog[0], prog.size(), "pptp_gre");
+}
+
+// -----------------------------------------------------------------------
+Proxy::XDPSocket::XDPSocket(
+    Proxy   *_proxy,
+    int     _ifIndex,
+    int     _queue
+)
+    :
+        proxy(_proxy),
+        fd(-1),
+        ifIndex(_ifIndex),
+        queue(_queue),
+        umem(0)
+{
+    memset(&fill, 0, sizeof(fill));
+    memset(&completion, 0, sizeof(completion));
+    memset(&rx, 0, sizeof(rx));
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::XDPSocket::mapRing(
+    Ring                        *ring,
+    const struct xdp_ring_offset *offsets,
+    uint64_t                    pgoff,
+    int                         descSize
+)
+{
+    size_t length = offsets->desc + XDP_RING_SIZE*descSize;
+    uint8_t *map = (uint8_t*)mmap(0, length, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, pgoff);
+    if(map==MAP_FAILED)
+    {
+        proxy->FAIL(false, "mmap", "couldn't map AF_XDP ring on queue %d", queue);
+        return false;
+    }
+
+    ring->producer = (uint32_t*)(map + offsets->producer);
+    ring->consumer = (uint32_t*)(map + offsets->consumer);
+    ring->descs = map + offsets->desc;
+    ring->mask = XDP_RING_SIZE-1;
+    return true;
+}
+
+// -----------------------------------------------------------------------
+bool Proxy::XDPSocket::open()
+{
+    fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if(fd<0)
+    {
+        proxy->FAIL(false, "socket", "couldn't create AF_XDP socket");
+        return false;
+    }
+
+    size_t umemSize = XDP_RING_SIZE*XDP_FRAME_SIZE;
+    void *map = mmap(0, umemSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+    if(map==MAP_FAILED)
+    {
+        proxy->FAIL(false, "mmap", "couldn't allocate AF_XDP UMEM");
+        return false;
+    }
+    umem = (uint8_t*)map;
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(uintptr_t)umem;
+    reg.len = umemSize;
+    reg.chunk_size = XDP_FRAME_SIZE;
+    reg.headroom = 0;
+    if(setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg))<0)
+    {
+        proxy->FAIL(false, "setsockopt", "setsockopt(XDP_UMEM_REG) failed");
+        return false;
+    }
+
+    int size = XDP_RING_SIZE;
+    if(
+        setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size))<0          ||
+        setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size))<0    ||
+        setsockopt(fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size))<0
+    )
+    {
+        proxy->FAIL(false, "setsockopt", "couldn't size AF_XDP rings");
+        return false;
+    }
+
+    struct xdp_mmap_offsets offsets;
+    socklen_t offsetsLen = sizeof(offsets);
+    if(getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsetsLen)<0)
+    {
+        proxy->FAIL(false, "getsockopt", "getsockopt(XDP_MMAP_OFFSETS) failed");
+        return false;
+    }
+
+    bool ok =
+        mapRing(&fill, &offsets.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t))               &&
+        mapRing(&completion, &offsets.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t))   &&
+        mapRing(&rx, &offsets.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc));
+    if(ok==false) return false;
+
+    // Hand every frame to the kernel up front
+    uint64_t *addrs = (uint64_t*)fill.descs;
+    for(int i=0; i<XDP_RING_SIZE; ++i) addrs[i] = (uint64_t)i*XDP_FRAME_SIZE;
+    __atomic_store_n(fill.producer, XDP_RING_SIZE, __ATOMIC_RELEASE);
+
+    struct sockaddr_xdp addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifIndex;
+    addr.sxdp_queue_id = queue;
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr))<0)
+    {
+        proxy->FAIL(false, "bind", "couldn't bind AF_XDP socket to queue %d", queue);
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------
+int Proxy::XDPSocket::receive(
+    uint8_t     **frames,
+    int         *lengths,
+    int         max
+)
+{
+    while(1)
+    {
+        uint32_t cons = *rx.consumer;
+        uint32_t prod = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE);
+        int n = (int)(prod-cons);
+        if(0<n)
+        {
+            if(max<n) n = max;
+            struct xdp_desc *descs = (struct xdp_desc*)rx.descs;
+            for(int i=0; i<n; ++i)
+            {
+                struct xdp_desc *desc = descs + ((cons+i) & rx.mask);
+                frames[i] = umem + desc->addr;
+                lengths[i] = desc->len;
+            }
+            return n;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, -1)<0 && errno!=EINTR)
+        {
+            proxy->FAIL(false, "poll", "poll failed on AF_XDP socket");
+            return -1;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------
+void Proxy::XDPSocket::recycle(
+    int n
+)
+{
+    // Frames go back into the fill ring in the order they came out of the RX ring
+    uint32_t cons = *rx.consumer;
+    uint32_t prod = *fill.producer;
+    struct xdp_desc *descs = (struct xdp_desc*)rx.descs;
+    uint64_t *addrs = (uint64_t*)fill.descs;
+    for(int i=0; i<n; ++i)
+    {
+        uint64_t addr = descs[(cons+i) & rx.mask].addr;
+        addrs[(prod+i) & fill.mask] = addr - (addr % XDP_FRAME_SIZE);
+    }
+    __atomic_store_n(rx.consumer, cons+n, __ATOMIC_RELEASE);
+    __atomic_store_n(fill.producer, prod+n, __ATOMIC_RELEASE);
+}
+
+// -----------------------------------------------------------------------
+static int countQueues(
+    const char *interface
+)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", interface);
+    DIR *dir = opendir(path);
+    if(dir==0) return 1;
+
+    int n = 0;
+    struct dirent *entry;
+    while((entry = readdir(dir))!=0)
+    {
+        if(0==strncmp(entry->d_name, "rx-", 3)) ++n;
+    }
+    closedir(dir);
+    return n<1 ? 1 : n;
+}
+
+// -----------------------------------------------------------------------
+void Proxy::startXDP()
+{
+    int n = xdpInterfaces.size();
+    if(n==0) return;
+
+    xdpCallMap = bpfMapCreate(BPF_MAP_TYPE_HASH, sizeof(CallKey), sizeof(uint32_t), XDP_MAX_CALLS, "pptp_calls");
+    if(xdpCallMap<0) FAIL(true, 0, "AF_XDP needs BPF support, are we root ?");
+
+    for(int i=0; i<n; ++i)
+    {
+        const char *interface = xdpInterfaces[i];
+        int ifIndex = if_nametoindex(interface);
+        if(ifIndex==0) FAIL(true, "if_nametoindex", "unknown interface %s", interface);
+
+        int nbQueues = countQueues(interface);
+        int xskMap = bpfMapCreate(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t), sizeof(uint32_t), nbQueues, "pptp_xsks");
+        int prog = xskMap<0 ? -1 : xdpProgram(xskMap);
+        if(prog<0) FAIL(true, 0, "couldn't build XDP program for interface %s", interface);
+
+        // Native mode where the driver has it, generic mode works everywhere
+        const char *mode = "native";
+        int link = bpfLinkCreate(prog, ifIndex, BPF_XDP, XDP_FLAGS_DRV_MODE);
+        if(link<0)
+        {
+            mode = "generic";
+            link = bpfLinkCreate(prog, ifIndex, BPF_XDP, XDP_FLAGS_SKB_MODE);
+        }
+        if(link<0) FAIL(true, "bpf", "couldn't attach XDP program to interface %s", interface);
+
+        INFO("XDP program attached to %s in %s mode, %d queue(s)", interface, mode, nbQueues);
+        for(int q=0; q<nbQueues; ++q)
+        {
+            XDPSocket *xsk = new XDPSocket(this, ifIndex, q);
+            if(xsk->open()==false) FAIL(true, 0, "couldn't open AF_XDP socket on %s queue %d", interface, q);
+
+            int fd = xsk->getSocket();
+            if(bpfMapUpdate(xskMap, &q, &fd)==false)
+            {
+                FAIL(true, "bpf", "couldn't register AF_XDP socket for %s queue %d", interface, q);
+            }
+
+            int trunk = trunkPort ? makeTrunkSocket(false) : -1;
+            GREWorker *worker = new GREWorker(this, greWorkers.size(), xsk->getSocket(), makeGRESocket(false), 0, xsk, trunk, false);
+            greWorkers.push_back(worker);
+            worker->start();
+        }
+    }
+}
+
+#else // linux
+
+// -----------------------------------------------------------------------
+void Proxy::startXDP()
+{
+}
+
+#endif // linux